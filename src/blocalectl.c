@@ -0,0 +1,568 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+/*
+  A client for blocaled, doing what localectl does on systemd systems.
+
+  Every command goes through one connection. The proxies do not load
+  nor follow the properties: status fetches them all with a single
+  GetAll, and again only when a set-* command may have changed them, so
+  that a batch of commands read from stdin costs no more round trips
+  than needed.
+*/
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "extensions-generated.h"
+#include "locale1-generated.h"
+
+#include "config.h"
+
+#define BUS_NAME "org.freedesktop.locale1"
+#define INTERFACE_NAME "org.freedesktop.locale1"
+#define OBJECT_PATH "/org/freedesktop/locale1"
+
+static gboolean no_convert = FALSE;
+static gboolean no_ask_password = FALSE;
+static gboolean batch = FALSE;
+static gboolean print_version = FALSE;
+static gchar *address = NULL;
+
+static GDBusConnection *connection = NULL;
+static BLocaledLocale1 *locale1 = NULL;
+static BLocaledLocale1Extensions *extensions = NULL;
+
+/* Whether the cached properties of locale1 are those of blocaled */
+static gboolean properties_current = FALSE;
+
+/* The result of ListX11Layouts, which the list-x11-* commands share */
+static gchar **x11_layouts = NULL;
+static gchar **x11_models = NULL;
+static GVariant *x11_variants = NULL;
+static gchar **x11_options = NULL;
+
+static GOptionEntry option_entries[] =
+{
+    { "no-convert", 0, 0, G_OPTION_ARG_NONE, &no_convert, "Do not convert between the console and X11 keymaps", NULL },
+    { "no-ask-password", 0, 0, G_OPTION_ARG_NONE, &no_ask_password, "Do not ask for a password when authorization is needed", NULL },
+    { "batch", 0, 0, G_OPTION_ARG_NONE, &batch, "Read the commands from stdin, one per line", NULL },
+    { "address", 0, 0, G_OPTION_ARG_STRING, &address, "Connect to blocaled at this address instead of the system bus", "Address" },
+    { "version", 0, 0, G_OPTION_ARG_NONE, &print_version, "Show version information", NULL },
+    { NULL }
+};
+
+static gboolean
+connect_blocaled (GError **error)
+{
+    if (connection != NULL)
+        return TRUE;
+
+    if (address != NULL)
+        /* A private socket of blocaled (the privatesocket setting) */
+        connection = g_dbus_connection_new_for_address_sync (address,
+                                                             G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                                             NULL, NULL, error);
+    else
+        connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, error);
+    return connection != NULL;
+}
+
+/* There is no bus name to talk to on a private socket */
+static const gchar *
+bus_name (void)
+{
+    return address != NULL ? NULL : BUS_NAME;
+}
+
+/* The user may take long to type a password: the default timeout of
+   about 25 seconds would turn a slow answer into an error */
+static void
+proxy_set_timeout (GDBusProxy *proxy)
+{
+    if (!no_ask_password)
+        g_dbus_proxy_set_default_timeout (proxy, G_MAXINT);
+}
+
+static BLocaledLocale1 *
+get_locale1 (GError **error)
+{
+    if (locale1 == NULL && connect_blocaled (error)) {
+        locale1 = blocaled_locale1_proxy_new_sync (connection,
+                                                   G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                                   G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                   bus_name (), OBJECT_PATH, NULL, error);
+        if (locale1 != NULL)
+            proxy_set_timeout (G_DBUS_PROXY (locale1));
+    }
+    return locale1;
+}
+
+static BLocaledLocale1Extensions *
+get_extensions (GError **error)
+{
+    if (extensions == NULL && connect_blocaled (error)) {
+        extensions = blocaled_locale1_extensions_proxy_new_sync (connection,
+                                                                 G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                                                 G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                                 bus_name (), OBJECT_PATH, NULL, error);
+        if (extensions != NULL)
+            proxy_set_timeout (G_DBUS_PROXY (extensions));
+    }
+    return extensions;
+}
+
+/**
+ * load_properties:
+ * @error: return location for an error
+ *
+ * Fill the property cache of the locale1 proxy with a single GetAll
+ * call, unless it is current.
+ *
+ * Returns: %TRUE on success
+ */
+
+static gboolean
+load_properties (GError **error)
+{
+    GVariant *result, *value;
+    GVariantIter *iter;
+    const gchar *name;
+
+    if (get_locale1 (error) == NULL)
+        return FALSE;
+    if (properties_current)
+        return TRUE;
+
+    result = g_dbus_connection_call_sync (connection, bus_name (), OBJECT_PATH,
+                                          "org.freedesktop.DBus.Properties", "GetAll",
+                                          g_variant_new ("(s)", INTERFACE_NAME),
+                                          G_VARIANT_TYPE ("(a{sv})"),
+                                          G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+    if (result == NULL)
+        return FALSE;
+
+    g_variant_get (result, "(a{sv})", &iter);
+    while (g_variant_iter_next (iter, "{&sv}", &name, &value)) {
+        g_dbus_proxy_set_cached_property (G_DBUS_PROXY (locale1), name, value);
+        g_variant_unref (value);
+    }
+    g_variant_iter_free (iter);
+    g_variant_unref (result);
+    properties_current = TRUE;
+    return TRUE;
+}
+
+static gboolean
+load_x11_lists (GError **error)
+{
+    if (x11_layouts != NULL)
+        return TRUE;
+    if (get_extensions (error) == NULL)
+        return FALSE;
+    return blocaled_locale1_extensions_call_list_x11_layouts_sync (extensions,
+                                                                   &x11_layouts,
+                                                                   &x11_models,
+                                                                   &x11_variants,
+                                                                   &x11_options,
+                                                                   NULL, error);
+}
+
+static void
+print_setting (const gchar *title,
+               const gchar *value,
+               gboolean always)
+{
+    if (value != NULL && *value != '\0')
+        g_print ("%16s: %s\n", title, value);
+    else if (always)
+        g_print ("%16s: n/a\n", title);
+}
+
+static void
+print_strv (const gchar * const *strv)
+{
+    for (; strv != NULL && *strv != NULL; strv++)
+        g_print ("%s\n", *strv);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+    return g_strcmp0 (*(const gchar **) a, *(const gchar **) b);
+}
+
+static gboolean
+run_status (gchar **args,
+            GError **error)
+{
+    const gchar * const *loc;
+
+    if (!load_properties (error))
+        return FALSE;
+
+    loc = blocaled_locale1_get_locale (locale1);
+    if (loc == NULL || *loc == NULL)
+        print_setting ("System Locale", NULL, TRUE);
+    else {
+        print_setting ("System Locale", *loc, TRUE);
+        for (loc++; *loc != NULL; loc++)
+            g_print ("%16s  %s\n", "", *loc);
+    }
+    print_setting ("VC Keymap", blocaled_locale1_get_vconsole_keymap (locale1), TRUE);
+    print_setting ("VC Toggle Keymap", blocaled_locale1_get_vconsole_keymap_toggle (locale1), FALSE);
+    print_setting ("X11 Layout", blocaled_locale1_get_x11_layout (locale1), TRUE);
+    print_setting ("X11 Model", blocaled_locale1_get_x11_model (locale1), FALSE);
+    print_setting ("X11 Variant", blocaled_locale1_get_x11_variant (locale1), FALSE);
+    print_setting ("X11 Options", blocaled_locale1_get_x11_options (locale1), FALSE);
+    return TRUE;
+}
+
+static gboolean
+run_set_locale (gchar **args,
+                GError **error)
+{
+    gchar **locale;
+    gboolean ret;
+    guint i;
+
+    if (get_locale1 (error) == NULL)
+        return FALSE;
+
+    /* As with localectl, a bare locale name is for LANG */
+    locale = g_new0 (gchar *, g_strv_length (args) + 1);
+    for (i = 0; args[i] != NULL; i++)
+        locale[i] = strchr (args[i], '=') != NULL ? g_strdup (args[i]) : g_strconcat ("LANG=", args[i], NULL);
+
+    ret = blocaled_locale1_call_set_locale_sync (locale1, (const gchar * const *) locale,
+                                                 !no_ask_password, NULL, error);
+    properties_current = FALSE;
+    g_strfreev (locale);
+    return ret;
+}
+
+static gboolean
+run_set_keymap (gchar **args,
+                GError **error)
+{
+    gboolean ret;
+
+    if (get_locale1 (error) == NULL)
+        return FALSE;
+
+    ret = blocaled_locale1_call_set_vconsole_keyboard_sync (locale1, args[0],
+                                                            args[1] != NULL ? args[1] : "",
+                                                            !no_convert, !no_ask_password,
+                                                            NULL, error);
+    properties_current = FALSE;
+    return ret;
+}
+
+static gboolean
+run_set_x11_keymap (gchar **args,
+                    GError **error)
+{
+    const gchar *model = "", *variant = "", *options = "";
+    gboolean ret;
+
+    if (get_locale1 (error) == NULL)
+        return FALSE;
+
+    if (args[1] != NULL) {
+        model = args[1];
+        if (args[2] != NULL) {
+            variant = args[2];
+            if (args[3] != NULL)
+                options = args[3];
+        }
+    }
+    ret = blocaled_locale1_call_set_x11_keyboard_sync (locale1, args[0], model, variant, options,
+                                                       !no_convert, !no_ask_password,
+                                                       NULL, error);
+    properties_current = FALSE;
+    return ret;
+}
+
+static gboolean
+run_list_locales (gchar **args,
+                  GError **error)
+{
+    gchar **locales = NULL;
+
+    if (get_extensions (error) == NULL ||
+        !blocaled_locale1_extensions_call_list_locales_sync (extensions, &locales, NULL, error))
+        return FALSE;
+    print_strv ((const gchar * const *) locales);
+    g_strfreev (locales);
+    return TRUE;
+}
+
+static gboolean
+run_list_keymaps (gchar **args,
+                  GError **error)
+{
+    gchar **keymaps = NULL;
+
+    if (get_extensions (error) == NULL ||
+        !blocaled_locale1_extensions_call_list_vconsole_keymaps_sync (extensions, &keymaps, NULL, error))
+        return FALSE;
+    print_strv ((const gchar * const *) keymaps);
+    g_strfreev (keymaps);
+    return TRUE;
+}
+
+static gboolean
+run_list_x11_models (gchar **args,
+                     GError **error)
+{
+    if (!load_x11_lists (error))
+        return FALSE;
+    print_strv ((const gchar * const *) x11_models);
+    return TRUE;
+}
+
+static gboolean
+run_list_x11_layouts (gchar **args,
+                      GError **error)
+{
+    if (!load_x11_lists (error))
+        return FALSE;
+    print_strv ((const gchar * const *) x11_layouts);
+    return TRUE;
+}
+
+static gboolean
+run_list_x11_variants (gchar **args,
+                       GError **error)
+{
+    GPtrArray *variants;
+    GVariantIter iter;
+    const gchar *layout, *variant, *last = NULL;
+    guint i;
+
+    if (!load_x11_lists (error))
+        return FALSE;
+
+    /* Without a layout, the variants of all layouts, each once */
+    variants = g_ptr_array_new ();
+    g_variant_iter_init (&iter, x11_variants);
+    while (g_variant_iter_next (&iter, "(&s&s)", &layout, &variant))
+        if (args[0] == NULL || g_strcmp0 (args[0], layout) == 0)
+            g_ptr_array_add (variants, (gpointer) variant);
+    g_ptr_array_sort (variants, compare_strings);
+    for (i = 0; i < variants->len; i++) {
+        if (g_strcmp0 (last, variants->pdata[i]) != 0)
+            g_print ("%s\n", (const gchar *) variants->pdata[i]);
+        last = variants->pdata[i];
+    }
+    g_ptr_array_free (variants, TRUE);
+    return TRUE;
+}
+
+static gboolean
+run_list_x11_options (gchar **args,
+                      GError **error)
+{
+    if (!load_x11_lists (error))
+        return FALSE;
+    print_strv ((const gchar * const *) x11_options);
+    return TRUE;
+}
+
+struct command {
+    const gchar *name;
+    const gchar *usage;
+    guint min_args;
+    guint max_args;
+    gboolean (*run) (gchar **args, GError **error);
+};
+
+static const struct command commands[] = {
+    { "status", "", 0, 0, run_status },
+    { "set-locale", "LOCALE|VARIABLE=LOCALE...", 1, G_MAXUINT, run_set_locale },
+    { "set-keymap", "MAP [TOGGLEMAP]", 1, 2, run_set_keymap },
+    { "set-x11-keymap", "LAYOUT [MODEL [VARIANT [OPTIONS]]]", 1, 4, run_set_x11_keymap },
+    { "list-locales", "", 0, 0, run_list_locales },
+    { "list-keymaps", "", 0, 0, run_list_keymaps },
+    { "list-x11-keymap-models", "", 0, 0, run_list_x11_models },
+    { "list-x11-keymap-layouts", "", 0, 0, run_list_x11_layouts },
+    { "list-x11-keymap-variants", "[LAYOUT]", 0, 1, run_list_x11_variants },
+    { "list-x11-keymap-options", "", 0, 0, run_list_x11_options },
+};
+
+static gchar *
+commands_summary (void)
+{
+    GString *summary = g_string_new ("Commands:");
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (commands); i++)
+        g_string_append_printf (summary, "\n  %s %s", commands[i].name, commands[i].usage);
+    return g_string_free (summary, FALSE);
+}
+
+/**
+ * run_command:
+ * @argv: the command and its arguments
+ *
+ * Run one command, and report its error, if any.
+ *
+ * Returns: %TRUE on success
+ */
+
+static gboolean
+run_command (gchar **argv)
+{
+    const struct command *command = NULL;
+    GError *error = NULL;
+    guint i, n_args;
+
+    for (i = 0; i < G_N_ELEMENTS (commands); i++)
+        if (g_strcmp0 (argv[0], commands[i].name) == 0) {
+            command = &commands[i];
+            break;
+        }
+    if (command == NULL) {
+        g_printerr ("Unknown command: %s\n", argv[0]);
+        return FALSE;
+    }
+
+    n_args = g_strv_length (argv + 1);
+    if (n_args < command->min_args || n_args > command->max_args) {
+        g_printerr ("Usage: %s %s\n", command->name, command->usage);
+        return FALSE;
+    }
+
+    if (!command->run (argv + 1, &error)) {
+        if (g_dbus_error_is_remote_error (error))
+            g_dbus_error_strip_remote_error (error);
+        g_printerr ("Failed to %s: %s\n", command->name, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Commands from stdin, one per line, with the shell quoting rules */
+static gboolean
+run_batch (void)
+{
+    GIOChannel *input;
+    GIOStatus status;
+    GError *error = NULL;
+    gchar *line = NULL;
+    gboolean ret = TRUE;
+    guint lineno = 0;
+
+    input = g_io_channel_unix_new (fileno (stdin));
+    while ((status = g_io_channel_read_line (input, &line, NULL, NULL, &error)) == G_IO_STATUS_NORMAL) {
+        gchar **argv = NULL;
+        gint argc;
+
+        lineno++;
+        g_strstrip (line);
+        if (*line != '\0' && *line != '#') {
+            if (!g_shell_parse_argv (line, &argc, &argv, &error)) {
+                g_printerr ("Line %u: %s\n", lineno, error->message);
+                g_clear_error (&error);
+                ret = FALSE;
+            } else if (!run_command (argv)) {
+                g_printerr ("Line %u failed\n", lineno);
+                ret = FALSE;
+            }
+            g_strfreev (argv);
+        }
+        g_free (line);
+        /* So that a reader of the output sees each result in turn */
+        fflush (stdout);
+    }
+    if (status == G_IO_STATUS_ERROR) {
+        g_printerr ("Failed to read the commands: %s\n", error->message);
+        g_error_free (error);
+        ret = FALSE;
+    }
+    g_io_channel_unref (input);
+    return ret;
+}
+
+gint
+main (gint argc, gchar *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *option_context;
+    gchar *summary;
+    gboolean ret;
+
+    setlocale (LC_ALL, "");
+
+    option_context = g_option_context_new ("[COMMAND [ARGUMENTS...]] - query and change the locale settings");
+    g_option_context_add_main_entries (option_context, option_entries, NULL);
+    summary = commands_summary ();
+    g_option_context_set_summary (option_context, summary);
+    g_free (summary);
+    if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+        g_printerr ("Failed to parse options: %s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (option_context);
+        return 1;
+    }
+    g_option_context_free (option_context);
+
+    if (print_version) {
+        g_print ("%s\n", PACKAGE_STRING);
+        return 0;
+    }
+
+    if (batch) {
+        if (argc > 1) {
+            g_printerr ("No command expected with --batch\n");
+            return 1;
+        }
+        ret = run_batch ();
+    } else if (argc > 1)
+        ret = run_command (argv + 1);
+    else {
+        gchar *status_argv[] = { "status", NULL };
+
+        ret = run_command (status_argv);
+    }
+
+    g_clear_object (&extensions);
+    g_clear_object (&locale1);
+    g_clear_object (&connection);
+    g_strfreev (x11_layouts);
+    g_strfreev (x11_models);
+    if (x11_variants != NULL)
+        g_variant_unref (x11_variants);
+    g_strfreev (x11_options);
+    g_free (address);
+    return ret ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _BLOCALED_SHM_H_
+#define _BLOCALED_SHM_H_
+
+/**
+ * SECTION: blocaled-shm
+ * @short_description: Reading the settings without D-Bus
+ * @title: State File
+ * @include: blocaled-shm.h
+ *
+ * When the statefile setting is set, blocaled publishes the current
+ * settings in that file, which readers map in memory. Reading it needs
+ * no connection and no call: the settings are copied out under a
+ * sequence lock, so that a reader never blocks blocaled, and retries if
+ * blocaled was writing meanwhile.
+ *
+ * The settings are text, one "NAME=value" per line: the locale
+ * variables (LANG, LC_*) which are set, then KEYMAP, KEYMAP_TOGGLE,
+ * X11_LAYOUT, X11_MODEL, X11_VARIANT and X11_OPTIONS, which may be
+ * empty. The generation is incremented each time they change, so that
+ * a reader can tell whether its copy is still current.
+ *
+ * This header has no dependency but the C library, and may be copied
+ * into other programs.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCALED_SHM_MAGIC 0x534c4342u /* "BCLS" in little endian */
+#define BLOCALED_SHM_VERSION 1
+#define BLOCALED_SHM_DATA_SIZE 8192
+#define BLOCALED_SHM_READ_TRIES 1000
+
+struct blocaled_shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;        /* of the whole file */
+    uint32_t length;      /* of the text in data */
+    uint64_t sequence;    /* odd while the text is being written */
+    uint64_t generation;  /* incremented when the text changes */
+    char data[BLOCALED_SHM_DATA_SIZE];
+};
+
+/**
+ * blocaled_shm_open:
+ * @path: the state file
+ *
+ * Map the state file read-only. The mapping stays valid when blocaled
+ * restarts, since the file is then reused.
+ *
+ * Returns: the mapping, or %NULL with errno set. Release it with
+ * #blocaled_shm_close.
+ */
+
+static inline const struct blocaled_shm *
+blocaled_shm_open (const char *path)
+{
+    struct blocaled_shm *shm;
+    struct stat st;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (struct blocaled_shm)) {
+        close (fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    shm = mmap (NULL, sizeof (struct blocaled_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (shm->magic != BLOCALED_SHM_MAGIC || shm->version != BLOCALED_SHM_VERSION) {
+        munmap (shm, sizeof (struct blocaled_shm));
+        errno = EPROTO;
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void
+blocaled_shm_close (const struct blocaled_shm *shm)
+{
+    if (shm != NULL)
+        munmap ((void *) shm, sizeof (struct blocaled_shm));
+}
+
+/**
+ * blocaled_shm_generation:
+ * @shm: a mapping
+ *
+ * Returns: the current generation, to compare with the one returned by
+ * #blocaled_shm_read
+ */
+
+static inline uint64_t
+blocaled_shm_generation (const struct blocaled_shm *shm)
+{
+    return __atomic_load_n (&shm->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * blocaled_shm_read:
+ * @shm: a mapping
+ * @buf: where to copy the settings, as a nul terminated string
+ * @size: the size of @buf, BLOCALED_SHM_DATA_SIZE + 1 is always enough
+ * @generation: (out) (optional): the generation of the copy
+ *
+ * Take a consistent copy of the settings, without locking. Gives up
+ * after BLOCALED_SHM_READ_TRIES attempts, rather than waiting for a
+ * writer which may be gone.
+ *
+ * Returns: 0 on success, -1 with errno set to ERANGE if @buf is too
+ * small, or to EAGAIN if no consistent copy could be taken
+ */
+
+static inline int
+blocaled_shm_read (const struct blocaled_shm *shm,
+                   char *buf,
+                   size_t size,
+                   uint64_t *generation)
+{
+    uint64_t begin, end, gen;
+    uint32_t length;
+    int tries;
+
+    for (tries = 0; ; tries++) {
+        if (tries == BLOCALED_SHM_READ_TRIES) {
+            errno = EAGAIN;
+            return -1;
+        }
+        begin = __atomic_load_n (&shm->sequence, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            /* Being written: a few hundred nanoseconds */
+            sched_yield ();
+            continue;
+        }
+        length = __atomic_load_n (&shm->length, __ATOMIC_RELAXED);
+        gen = __atomic_load_n (&shm->generation, __ATOMIC_RELAXED);
+        if (length > BLOCALED_SHM_DATA_SIZE)
+            length = BLOCALED_SHM_DATA_SIZE;
+        if (length < size)
+            memcpy (buf, shm->data, length);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        end = __atomic_load_n (&shm->sequence, __ATOMIC_RELAXED);
+        if (begin == end)
+            break;
+    }
+    if (length >= size) {
+        errno = ERANGE;
+        return -1;
+    }
+    buf[length] = '\0';
+    if (generation != NULL)
+        *generation = gen;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "fileindex.h"
+
+#include "config.h"
+
+struct _FileIndex {
+    gchar *name;           /* for the logs */
+    FileIndexBuildFunc build;
+    gpointer user_data;
+    GHashTable *set;       /* NULL until built, or when stale */
+    GHashTable *monitors;  /* path -> GFileMonitor */
+};
+
+static void
+on_watched_file_changed (GFileMonitor *monitor,
+                         GFile *file,
+                         GFile *other_file,
+                         GFileMonitorEvent event_type,
+                         gpointer user_data)
+{
+    FileIndex *index = (FileIndex *) user_data;
+
+    if (index->set == NULL)
+        return;
+
+    g_debug ("%s index is stale", index->name);
+    g_clear_pointer (&index->set, g_hash_table_destroy);
+}
+
+/**
+ * file_index_watch:
+ * @index: the index
+ * @path: a file or directory
+ *
+ * Mark the index stale when @path changes, in addition to the paths
+ * given to #file_index_new. May be called from the build function, for
+ * example for each directory of a tree, as they are found. Watching the
+ * same path twice has no effect.
+ */
+
+void
+file_index_watch (FileIndex *index,
+                  const gchar *path)
+{
+    GFile *file;
+    GFileMonitor *monitor;
+    GError *err = NULL;
+
+    if (g_hash_table_contains (index->monitors, path))
+        return;
+
+    file = g_file_new_for_path (path);
+    /* g_file_monitor works for files and directories, existing or not */
+    if ((monitor = g_file_monitor (file, G_FILE_MONITOR_NONE, NULL, &err)) == NULL) {
+        g_debug ("Cannot watch '%s': %s", path, err->message);
+        g_clear_error (&err);
+    } else {
+        g_signal_connect (monitor, "changed", G_CALLBACK (on_watched_file_changed), index);
+        g_hash_table_insert (index->monitors, g_strdup (path), monitor);
+    }
+    g_object_unref (file);
+}
+
+/**
+ * file_index_new:
+ * @name: what is indexed, for the logs
+ * @watched_paths: %NULL terminated list of the files and directories the
+ * index is built from
+ * @build: function building the index
+ * @user_data: passed to @build
+ *
+ * Create an index, which is built on first use
+ *
+ * Returns: a FileIndex. Free with #file_index_free
+ */
+
+FileIndex *
+file_index_new (const gchar *name,
+                const gchar * const *watched_paths,
+                FileIndexBuildFunc build,
+                gpointer user_data)
+{
+    FileIndex *index = g_new0 (FileIndex, 1);
+    const gchar * const *path;
+
+    index->name = g_strdup (name);
+    index->build = build;
+    index->user_data = user_data;
+    index->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    for (path = watched_paths; path != NULL && *path != NULL; path++)
+        file_index_watch (index, *path);
+    return index;
+}
+
+static GHashTable *
+file_index_get_set (FileIndex *index)
+{
+    if (index->set == NULL) {
+        index->set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        index->build (index->set, index->user_data);
+        g_debug ("%s index built: %u entries", index->name, g_hash_table_size (index->set));
+    }
+    return index->set;
+}
+
+/**
+ * file_index_ensure_built:
+ * @index: the index
+ *
+ * Build the index now if it has never been built or is stale, calling
+ * its build function
+ */
+
+void
+file_index_ensure_built (FileIndex *index)
+{
+    file_index_get_set (index);
+}
+
+/**
+ * file_index_contains:
+ * @index: the index
+ * @key: the string to look up
+ *
+ * Returns: %TRUE if @key is in the index
+ */
+
+gboolean
+file_index_contains (FileIndex *index,
+                     const gchar *key)
+{
+    return g_hash_table_contains (file_index_get_set (index), key);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+    return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/**
+ * file_index_list:
+ * @index: the index
+ *
+ * Returns: a newly allocated, sorted, %NULL terminated vector of the
+ * strings in @index. Free with g_strfreev.
+ */
+
+gchar **
+file_index_list (FileIndex *index)
+{
+    GHashTable *set = file_index_get_set (index);
+    GHashTableIter iter;
+    gpointer key;
+    gchar **ret;
+    guint i = 0;
+
+    ret = g_new0 (gchar *, g_hash_table_size (set) + 1);
+    g_hash_table_iter_init (&iter, set);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        ret[i++] = g_strdup ((const gchar *) key);
+    qsort (ret, i, sizeof (gchar *), compare_strings);
+    return ret;
+}
+
+/**
+ * file_index_free:
+ * @index: (nullable): the index to free
+ *
+ * Stop watching the files, and free the index
+ */
+
+void
+file_index_free (FileIndex *index)
+{
+    GHashTableIter iter;
+    gpointer monitor;
+
+    if (index == NULL)
+        return;
+
+    g_hash_table_iter_init (&iter, index->monitors);
+    while (g_hash_table_iter_next (&iter, NULL, &monitor)) {
+        g_signal_handlers_disconnect_by_data (monitor, index);
+        g_file_monitor_cancel (G_FILE_MONITOR (monitor));
+    }
+    g_hash_table_destroy (index->monitors);
+    if (index->set != NULL)
+        g_hash_table_destroy (index->set);
+    g_free (index->name);
+    g_free (index);
+}
@@ -0,0 +1,80 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _FILE_INDEX_H_
+#define _FILE_INDEX_H_
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION: fileindex
+ * @short_description: Sets of names built from system files
+ * @title: File Indexes
+ * @include: fileindex.h
+ *
+ * A FileIndex is a set of strings (for example the installed locales)
+ * computed from some files or directories. It is built when first
+ * needed, and the watched files are monitored: when one of them
+ * changes, the index is built again on next use.
+ */
+
+typedef struct _FileIndex FileIndex;
+
+/**
+ * FileIndexBuildFunc:
+ * @set: an empty set (a #GHashTable owning its string keys) to fill
+ * @user_data: the data passed to #file_index_new
+ *
+ * Fill @set from the watched files. Missing files are not an error.
+ */
+
+typedef void (*FileIndexBuildFunc) (GHashTable *set,
+                                    gpointer user_data);
+
+FileIndex *
+file_index_new (const gchar *name,
+                const gchar * const *watched_paths,
+                FileIndexBuildFunc build,
+                gpointer user_data);
+
+void
+file_index_watch (FileIndex *index,
+                  const gchar *path);
+
+void
+file_index_ensure_built (FileIndex *index);
+
+gboolean
+file_index_contains (FileIndex *index,
+                     const gchar *key);
+
+gchar **
+file_index_list (FileIndex *index);
+
+void
+file_index_free (FileIndex *index);
+
+#endif
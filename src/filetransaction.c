@@ -0,0 +1,537 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "filetransaction.h"
+#include "probes.h"
+#include "stats.h"
+
+#include "config.h"
+
+/*
+  How a transaction works:
+  - stage: the new content of a file is written to a temporary file in
+    the same directory as the target (so that rename(2) is atomic). The
+    temporary file gets the mode and owner of the file it replaces.
+  - commit: the temporary files are fsync'ed concurrently, one thread per
+    file, so that the latency is that of the slowest file, not the sum.
+    Then each target is hard linked to a backup name, and the temporary
+    files are renamed over the targets. If a rename fails, the targets
+    already renamed are restored from their backups (or removed if they
+    did not exist before). Finally the backups are removed and the
+    directories are synced.
+  - free: whatever has not been committed is removed.
+
+  With the "deferred" durability level, the temporary files are renamed
+  without being synced first, and kept open. A background thread then
+  syncs them, and their directories. With the "none" level, there is no
+  sync at all.
+*/
+
+struct staged_file {
+    gchar *filename;   /* target, symlinks resolved */
+    gchar *dirname;
+    gchar *tmpname;
+    gchar *backupname; /* NULL if there is no backup of the target */
+    gint fd;
+    gboolean existed;
+    gint sync_errno;
+    gboolean renamed;
+};
+
+struct _FileTransaction {
+    GList *staged;     /* list of struct staged_file, in staging order */
+    gboolean committed;
+};
+
+static FileTransactionDurability durability = FILE_TRANSACTION_DURABILITY_FULL;
+static GThreadPool *deferred_pool = NULL;
+
+static void
+staged_file_free (struct staged_file *staged)
+{
+    if (staged == NULL)
+        return;
+
+    if (staged->fd >= 0)
+        close (staged->fd);
+    if (staged->tmpname != NULL && !staged->renamed)
+        g_unlink (staged->tmpname);
+    g_free (staged->filename);
+    g_free (staged->dirname);
+    g_free (staged->tmpname);
+    g_free (staged->backupname);
+    g_free (staged);
+}
+
+/**
+ * file_transaction_durability_from_string:
+ * @string: one of "full", "deferred", or "none"
+ * @durability: (out): where to store the result
+ *
+ * Parse a durability level, as found in the configuration file
+ *
+ * Returns: %TRUE if @string is a valid durability level, %FALSE otherwise
+ */
+
+gboolean
+file_transaction_durability_from_string (const gchar *string,
+                                         FileTransactionDurability *durability)
+{
+    if (!g_strcmp0 (string, "full"))
+        *durability = FILE_TRANSACTION_DURABILITY_FULL;
+    else if (!g_strcmp0 (string, "deferred"))
+        *durability = FILE_TRANSACTION_DURABILITY_DEFERRED;
+    else if (!g_strcmp0 (string, "none"))
+        *durability = FILE_TRANSACTION_DURABILITY_NONE;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+/**
+ * file_transaction_set_durability:
+ * @_durability: the durability level of the next commits
+ *
+ * Set how the committed files are synced to storage. The default is
+ * %FILE_TRANSACTION_DURABILITY_FULL.
+ */
+
+void
+file_transaction_set_durability (FileTransactionDurability _durability)
+{
+    durability = _durability;
+}
+
+/**
+ * file_transaction_new:
+ *
+ * Allocate a new, empty, transaction
+ *
+ * Returns: a FileTransaction. Free with #file_transaction_free
+ */
+
+FileTransaction *
+file_transaction_new (void)
+{
+    return g_new0 (FileTransaction, 1);
+}
+
+/**
+ * file_transaction_free:
+ * @trans: (nullable): the transaction to free
+ *
+ * Free the transaction. If it has not been committed, the staged
+ * temporary files are removed, and the targets are left untouched.
+ */
+
+void
+file_transaction_free (FileTransaction *trans)
+{
+    if (trans == NULL)
+        return;
+
+    g_list_free_full (trans->staged, (GDestroyNotify)staged_file_free);
+    g_free (trans);
+}
+
+static gboolean
+write_all (gint fd,
+           const gchar *contents,
+           gsize length)
+{
+    while (length > 0) {
+        gssize written = write (fd, contents, length);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        contents += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+static void
+set_errno_error (GError **error,
+                 gint saved_errno,
+                 const gchar *filename)
+{
+    g_set_error (error,
+                 G_FILE_ERROR,
+                 g_file_error_from_errno (saved_errno),
+                 "Unable to save '%s': %s",
+                 filename,
+                 g_strerror (saved_errno));
+}
+
+/**
+ * file_transaction_stage:
+ * @trans: the transaction
+ * @file: the file to be replaced at commit time
+ * @contents: the new content of @file
+ * @length: the length of @contents
+ * @error: set in case of error
+ *
+ * Write @contents to a temporary file in the directory of @file, creating
+ * the directory if needed. Nothing is visible at @file until
+ * #file_transaction_commit is called.
+ *
+ * Returns: %FALSE in case of error, %TRUE if the operation succeeded.
+ */
+
+gboolean
+file_transaction_stage (FileTransaction *trans,
+                        GFile *file,
+                        const gchar *contents,
+                        gsize length,
+                        GError **error)
+{
+    struct staged_file *staged = NULL;
+    gchar *path = NULL, *basename = NULL;
+    struct stat st;
+    gboolean exists;
+    gint64 start = g_get_monotonic_time ();
+
+    g_assert (trans != NULL && !trans->committed);
+    g_assert (file != NULL && contents != NULL);
+
+    staged = g_new0 (struct staged_file, 1);
+    staged->fd = -1;
+
+    path = g_file_get_path (file);
+    /* Replace the file a symlink points to, not the symlink itself */
+    if (g_lstat (path, &st) == 0 && S_ISLNK (st.st_mode) &&
+        (staged->filename = realpath (path, NULL)) != NULL) {
+        /* realpath allocates with malloc */
+        gchar *resolved = g_strdup (staged->filename);
+        free (staged->filename);
+        staged->filename = resolved;
+    } else
+        staged->filename = g_strdup (path);
+
+    staged->dirname = g_path_get_dirname (staged->filename);
+    if (g_mkdir_with_parents (staged->dirname, 0755) == -1) {
+        g_set_error (error,
+                     G_FILE_ERROR,
+                     g_file_error_from_errno (errno),
+                     "Could not create directory '%s': %s",
+                     staged->dirname,
+                     strerror (errno)
+                    );
+        goto fail;
+    }
+
+    exists = g_stat (staged->filename, &st) == 0;
+    basename = g_path_get_basename (staged->filename);
+    staged->tmpname = g_strdup_printf ("%s/.%s.XXXXXX", staged->dirname, basename);
+    if ((staged->fd = g_mkstemp_full (staged->tmpname, O_RDWR | O_CLOEXEC, 0666)) < 0) {
+        set_errno_error (error, errno, path);
+        g_clear_pointer (&staged->tmpname, g_free);
+        goto fail;
+    }
+
+    /* g_mkstemp_full honors the umask, like g_file_replace did */
+    if (exists) {
+        staged->existed = TRUE;
+        if (fchmod (staged->fd, st.st_mode & 07777) == -1 ||
+            (fchown (staged->fd, st.st_uid, st.st_gid) == -1 && errno != EPERM))
+            g_debug ("Could not copy permissions of '%s': %s", staged->filename, strerror (errno));
+        staged->backupname = g_strdup_printf ("%s/.%s.blocaled-old", staged->dirname, basename);
+    }
+
+    if (!write_all (staged->fd, contents, length)) {
+        set_errno_error (error, errno, path);
+        goto fail;
+    }
+
+    g_debug ("Staged '%s' as '%s'", staged->filename, staged->tmpname);
+    trans->staged = g_list_append (trans->staged, staged);
+    stats_stage_add (STATS_STAGE_WRITE, start);
+    PROBE3 (file_stage, PROBE_REQUEST_ID, staged->filename, length);
+    g_free (path);
+    g_free (basename);
+    return TRUE;
+
+  fail:
+    staged_file_free (staged);
+    g_free (path);
+    g_free (basename);
+    return FALSE;
+}
+
+static gpointer
+staged_file_sync_thread (gpointer data)
+{
+    struct staged_file *staged = (struct staged_file *) data;
+
+    staged->sync_errno = fsync (staged->fd) == 0 ? 0 : errno;
+    return NULL;
+}
+
+static void
+sync_staged_files (GList *staged_list)
+{
+    GPtrArray *threads = g_ptr_array_new ();
+    GList *curr;
+    guint i;
+
+    /* The first file is synced by the calling thread, the others are
+       synced in parallel */
+    for (curr = staged_list ? staged_list->next : NULL; curr != NULL; curr = curr->next) {
+        GThread *thread = g_thread_try_new ("blocaled-fsync", staged_file_sync_thread, curr->data, NULL);
+
+        if (thread != NULL)
+            g_ptr_array_add (threads, thread);
+        else
+            staged_file_sync_thread (curr->data);
+    }
+    if (staged_list != NULL)
+        staged_file_sync_thread (staged_list->data);
+
+    for (i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+    g_ptr_array_free (threads, TRUE);
+}
+
+static gboolean
+sync_directories (GList *staged_list)
+{
+    GHashTable *done = g_hash_table_new (g_str_hash, g_str_equal);
+    GList *curr;
+    gboolean ret = TRUE;
+
+    for (curr = staged_list; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+        gint dirfd;
+
+        if (!g_hash_table_add (done, staged->dirname))
+            continue;
+        if ((dirfd = open (staged->dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+            continue;
+        if (fsync (dirfd) == -1) {
+            g_debug ("Could not sync directory '%s': %s", staged->dirname, strerror (errno));
+            ret = FALSE;
+        }
+        close (dirfd);
+    }
+    g_hash_table_destroy (done);
+    return ret;
+}
+
+/*
+  Deferred syncs run in a single worker thread, so that they are done in
+  order, and do not compete with each other for the storage.
+*/
+
+static void
+deferred_sync_func (gpointer data,
+                    gpointer user_data)
+{
+    GList *staged_list = (GList *) data;
+    GList *curr;
+    gboolean ok;
+    gint64 start = g_get_monotonic_time ();
+
+    sync_staged_files (staged_list);
+    ok = sync_directories (staged_list);
+    stats_stage_add (STATS_STAGE_FSYNC, start);
+
+    for (curr = staged_list; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+
+        if (staged->sync_errno != 0) {
+            g_warning ("Deferred sync of '%s' failed: %s", staged->filename, g_strerror (staged->sync_errno));
+            ok = FALSE;
+        } else
+            g_debug ("Deferred sync of '%s' done", staged->filename);
+    }
+
+    stats_counter_inc (ok ? STATS_DEFERRED_SYNC_OK : STATS_DEFERRED_SYNC_FAILED);
+    stats_gauge_add (STATS_GAUGE_DEFERRED_SYNCS, -1);
+    g_list_free_full (staged_list, (GDestroyNotify)staged_file_free);
+}
+
+static void
+defer_sync (FileTransaction *trans)
+{
+    GError *err = NULL;
+
+    if (deferred_pool == NULL)
+        deferred_pool = g_thread_pool_new (deferred_sync_func, NULL, 1, FALSE, &err);
+
+    stats_gauge_add (STATS_GAUGE_DEFERRED_SYNCS, 1);
+    if (deferred_pool == NULL || !g_thread_pool_push (deferred_pool, trans->staged, &err)) {
+        /* No thread: better late than never */
+        g_debug ("Could not defer sync: %s", err ? err->message : "no thread pool");
+        g_clear_error (&err);
+        deferred_sync_func (trans->staged, NULL);
+    }
+    trans->staged = NULL;
+}
+
+/**
+ * file_transaction_flush:
+ *
+ * Wait for the deferred syncs to complete. Must be called before exiting.
+ */
+
+void
+file_transaction_flush (void)
+{
+    if (deferred_pool == NULL)
+        return;
+
+    g_thread_pool_free (deferred_pool, FALSE, TRUE);
+    deferred_pool = NULL;
+}
+
+static void
+rollback_staged_files (GList *staged_list)
+{
+    GList *curr;
+
+    for (curr = staged_list; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+
+        if (!staged->renamed)
+            continue;
+        if (staged->backupname != NULL) {
+            if (g_rename (staged->backupname, staged->filename) == -1)
+                g_warning ("Could not restore '%s' from '%s': %s",
+                           staged->filename, staged->backupname, strerror (errno));
+            /* Either restored, or kept for the administrator */
+            g_clear_pointer (&staged->backupname, g_free);
+        } else if (staged->existed)
+            g_warning ("Could not restore '%s': no backup", staged->filename);
+        else
+            g_unlink (staged->filename);
+        staged->renamed = FALSE;
+        g_clear_pointer (&staged->tmpname, g_free);
+    }
+}
+
+/**
+ * file_transaction_commit:
+ * @trans: the transaction to commit
+ * @error: set in case of error
+ *
+ * Make all the staged files visible at their target location. Either all
+ * the targets are replaced, or none is.
+ *
+ * Returns: %FALSE in case of error, %TRUE if the operation succeeded.
+ */
+
+gboolean
+file_transaction_commit (FileTransaction *trans,
+                         GError **error)
+{
+    GList *curr;
+    gboolean ret = FALSE;
+    gint64 start;
+
+    g_assert (trans != NULL && !trans->committed);
+
+    PROBE2 (commit__start, PROBE_REQUEST_ID, g_list_length (trans->staged));
+    if (durability == FILE_TRANSACTION_DURABILITY_FULL) {
+        start = g_get_monotonic_time ();
+        sync_staged_files (trans->staged);
+        stats_stage_add (STATS_STAGE_FSYNC, start);
+    }
+
+    for (curr = trans->staged; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+        gint close_ret = 0;
+
+        /* With deferred syncs, the file is closed by the worker thread */
+        if (durability != FILE_TRANSACTION_DURABILITY_DEFERRED) {
+            close_ret = close (staged->fd);
+            staged->fd = -1;
+        }
+        if (staged->sync_errno != 0) {
+            set_errno_error (error, staged->sync_errno, staged->filename);
+            goto out;
+        }
+        if (close_ret == -1) {
+            set_errno_error (error, errno, staged->filename);
+            goto out;
+        }
+    }
+
+    start = g_get_monotonic_time ();
+    for (curr = trans->staged; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+
+        /* Keep the previous content reachable until everything is renamed */
+        if (staged->backupname != NULL) {
+            g_unlink (staged->backupname);
+            if (link (staged->filename, staged->backupname) == -1) {
+                g_debug ("Could not back up '%s': %s", staged->filename, strerror (errno));
+                g_clear_pointer (&staged->backupname, g_free);
+            }
+        }
+        if (g_rename (staged->tmpname, staged->filename) == -1) {
+            set_errno_error (error, errno, staged->filename);
+            rollback_staged_files (trans->staged);
+            goto out;
+        }
+        staged->renamed = TRUE;
+    }
+    stats_stage_add (STATS_STAGE_WRITE, start);
+
+    if (durability == FILE_TRANSACTION_DURABILITY_FULL) {
+        start = g_get_monotonic_time ();
+        sync_directories (trans->staged);
+        stats_stage_add (STATS_STAGE_FSYNC, start);
+    }
+    ret = TRUE;
+
+  out:
+    for (curr = trans->staged; curr != NULL; curr = curr->next) {
+        struct staged_file *staged = (struct staged_file *) curr->data;
+
+        if (staged->backupname != NULL)
+            g_unlink (staged->backupname);
+    }
+    trans->committed = TRUE;
+    if (ret && durability == FILE_TRANSACTION_DURABILITY_DEFERRED)
+        defer_sync (trans);
+    PROBE2 (commit__done, PROBE_REQUEST_ID, ret);
+    return ret;
+}
@@ -0,0 +1,92 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _FILE_TRANSACTION_H_
+#define _FILE_TRANSACTION_H_
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION: filetransaction
+ * @short_description: Write several settings files as a whole
+ * @title: File Transactions
+ * @include: filetransaction.h
+ *
+ * A FileTransaction collects the new content of one or more settings
+ * files. Each file is first written to a temporary file next to its
+ * target. On commit, all the temporary files are synced together, then
+ * renamed over their targets. If anything fails, the targets are left
+ * (or put back) in their previous state.
+ *
+ * How much syncing is done depends on the durability level set with
+ * #file_transaction_set_durability.
+ */
+
+typedef struct _FileTransaction FileTransaction;
+
+/**
+ * FileTransactionDurability:
+ * @FILE_TRANSACTION_DURABILITY_FULL: files and directories are synced
+ * before #file_transaction_commit returns
+ * @FILE_TRANSACTION_DURABILITY_DEFERRED: #file_transaction_commit returns
+ * after the renames, and the syncs are done in the background
+ * @FILE_TRANSACTION_DURABILITY_NONE: nothing is synced
+ */
+
+typedef enum {
+    FILE_TRANSACTION_DURABILITY_FULL,
+    FILE_TRANSACTION_DURABILITY_DEFERRED,
+    FILE_TRANSACTION_DURABILITY_NONE,
+} FileTransactionDurability;
+
+gboolean
+file_transaction_durability_from_string (const gchar *string,
+                                         FileTransactionDurability *durability);
+
+void
+file_transaction_set_durability (FileTransactionDurability durability);
+
+void
+file_transaction_flush (void);
+
+FileTransaction *
+file_transaction_new (void);
+
+gboolean
+file_transaction_stage (FileTransaction *trans,
+                        GFile *file,
+                        const gchar *contents,
+                        gsize length,
+                        GError **error);
+
+gboolean
+file_transaction_commit (FileTransaction *trans,
+                         GError **error);
+
+void
+file_transaction_free (FileTransaction *trans);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "fileindex.h"
+#include "keymapindex.h"
+
+#include "config.h"
+
+static FileIndex *keymap_index = NULL;
+static gchar *keymap_dir = NULL;
+
+/* The compressions loadkeys knows about */
+static const gchar *keymap_suffixes[] = {
+    ".map", ".map.gz", ".map.bz2", ".map.xz", ".map.zst", NULL
+};
+
+static void
+add_keymaps (GHashTable *set,
+             const gchar *directory)
+{
+    GDir *dir;
+    const gchar *name;
+
+    if ((dir = g_dir_open (directory, 0, NULL)) == NULL)
+        return;
+
+    /* New subdirectories and keymaps must also make the index stale */
+    file_index_watch (keymap_index, directory);
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *path = g_build_filename (directory, name, NULL);
+        const gchar **suffix;
+
+        /* Symlinked directories are skipped, as they could make a loop */
+        if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+            if (!g_file_test (path, G_FILE_TEST_IS_SYMLINK))
+                add_keymaps (set, path);
+        } else
+            for (suffix = keymap_suffixes; *suffix != NULL; suffix++)
+                if (g_str_has_suffix (name, *suffix) && strlen (name) > strlen (*suffix)) {
+                    g_hash_table_add (set, g_strndup (name, strlen (name) - strlen (*suffix)));
+                    break;
+                }
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+static void
+build_keymap_index (GHashTable *set,
+                    gpointer user_data)
+{
+    add_keymaps (set, keymap_dir);
+}
+
+/**
+ * keymap_index_init:
+ * @_keymap_dir: the kbd keymaps directory, normally
+ * %KEYMAP_INDEX_DEFAULT_DIR
+ *
+ * Prepare the index. Nothing is read before the first lookup.
+ */
+
+void
+keymap_index_init (const gchar *_keymap_dir)
+{
+    const gchar *watched[2];
+
+    keymap_dir = g_strdup (_keymap_dir);
+    /* The subdirectories are watched when the index is built */
+    watched[0] = keymap_dir;
+    watched[1] = NULL;
+    keymap_index = file_index_new ("Keymap", watched, build_keymap_index, NULL);
+}
+
+/**
+ * keymap_index_contains:
+ * @name: a keymap name, without directory or suffix
+ *
+ * Returns: %TRUE if a keymap named @name is installed
+ */
+
+gboolean
+keymap_index_contains (const gchar *name)
+{
+    g_assert (keymap_index != NULL);
+    return file_index_contains (keymap_index, name);
+}
+
+/**
+ * keymap_index_list:
+ *
+ * Returns: a sorted, %NULL terminated, vector of the installed keymaps.
+ * Free with g_strfreev.
+ */
+
+gchar **
+keymap_index_list (void)
+{
+    g_assert (keymap_index != NULL);
+    return file_index_list (keymap_index);
+}
+
+/**
+ * keymap_index_destroy:
+ *
+ * Free the index
+ */
+
+void
+keymap_index_destroy (void)
+{
+    g_clear_pointer (&keymap_index, file_index_free);
+    g_clear_pointer (&keymap_dir, g_free);
+}
@@ -0,0 +1,56 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _KEYMAP_INDEX_H_
+#define _KEYMAP_INDEX_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: keymapindex
+ * @short_description: Index of the virtual console keymaps
+ * @title: Keymap Index
+ * @include: keymapindex.h
+ *
+ * The keymaps are the files named NAME.map, possibly compressed, anywhere
+ * under the kbd keymaps directory. NAME is what loadkeys, and the KEYMAP
+ * variable, expect.
+ */
+
+#define KEYMAP_INDEX_DEFAULT_DIR "/usr/share/keymaps"
+
+void
+keymap_index_init (const gchar *keymap_dir);
+
+gboolean
+keymap_index_contains (const gchar *name);
+
+gchar **
+keymap_index_list (void);
+
+void
+keymap_index_destroy (void);
+
+#endif
@@ -22,15 +22,30 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <dbus/dbus-protocol.h> /* for the error names */
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#include "extensions-generated.h"
+#include "filetransaction.h"
+#include "keymapindex.h"
 #include "localed.h"
 #include "locale1-generated.h"
+#include "localeindex.h"
 #include "main.h"
+#include "peerserver.h"
 #include "polkitasync.h"
+#include "probes.h"
 #include "shellparser.h"
+#include "stateshm.h"
+#include "stats.h"
+#include "trace.h"
+#include "stats-generated.h"
+#include "xkbindex.h"
 
 #include "config.h"
 
@@ -38,8 +53,38 @@
 
 static guint bus_id = 0;
 static gboolean read_only = FALSE;
+static gboolean strict_locale = FALSE;
+static gboolean strict_keyboard = FALSE;
+static gboolean lazy_load = FALSE;
+static guint idle_timeout = 0;
+static guint idle_timeout_id = 0;
+static guint requests_in_flight = 0;
+static gchar *snapshot_file = NULL;
+static gchar *private_socket = NULL;
+static gchar *state_file = NULL;
+static guint state_publish_id = 0;
+
+#ifdef HAVE_SYS_SDT_H
+__thread guint64 probe_request_id = 0;
+#endif
+
+enum SETTINGS_FILE {
+    SETTINGS_FILE_LOCALE,
+    SETTINGS_FILE_KEYMAPS,
+    SETTINGS_FILE_X11,
+    SETTINGS_N_FILES
+};
+
+/* Whether the values of a file are known. In lazy mode, a file is only
+   read when first needed. */
+static gboolean settings_loaded[SETTINGS_N_FILES];
+
+static void
+settings_ensure_loaded (enum SETTINGS_FILE which);
 
 static BLocaledLocale1 *locale1 = NULL;
+static BLocaledLocale1Extensions *extensions = NULL;
+static BLocaledLocale1Stats *stats = NULL;
 
 static gchar *locale_variables[] = {
     "LANG", "LC_CTYPE", "LC_NUMERIC", "LC_TIME", "LC_COLLATE", "LC_MONETARY", "LC_MESSAGES", "LC_PAPER", "LC_NAME", "LC_ADDRESS", "LC_TELEPHONE", "LC_MEASUREMENT", "LC_IDENTIFICATION", NULL
@@ -64,7 +109,7 @@ G_LOCK_DEFINE_STATIC (locale);
  *  variables, we use the systemd defaults.
  */
 static gchar *keymap_variables[] = { "KEYMAP", "keymap", "KEYMAP_TOGGLE",
-                                     "KEYMAP_CORRECTIONS" };
+                                     "KEYMAP_CORRECTIONS", NULL };
 static gchar *keymap_var = "KEYMAP";
 static gchar *toggle_var = "KEYMAP_TOGGLE";
 static gchar *vconsole_keymap = NULL;
@@ -499,8 +544,10 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 {
     struct xorg_confd_parser *parser = NULL;
     gchar *filebuf = NULL, *line = NULL, *newline = NULL;
+    gsize length = 0;
     GList *input_class_section_start = NULL;
     gboolean in_section = FALSE, in_xkb_section = FALSE, finished = FALSE;
+    gint64 start;
 
     if (xorg_confd_file == NULL)
         return NULL;
@@ -508,8 +555,8 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
     parser = g_new0 (struct xorg_confd_parser, 1);
     parser->file = g_object_ref (xorg_confd_file);
     parser->filename = g_file_get_path (xorg_confd_file);
-    g_debug ("Parsing xorg.conf.d file: '%s'", parser->filename);
-    if (!g_file_load_contents (xorg_confd_file, NULL, &filebuf, NULL, NULL, error)) {
+    TRACE ("Parsing xorg.conf.d file: '%s'", parser->filename);
+    if (!g_file_load_contents (xorg_confd_file, NULL, &filebuf, &length, NULL, error)) {
         if (create) {
             filebuf = g_strdup ("# Automatically generated by blocaled\n"
                                 "# Minimal xorg.xonf for keyboard layout\n"
@@ -518,6 +565,7 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
                                 "        Identifier \"Blocaled Keyboard\"\n"
                                 "        MatchIsKeyboard \"on\"\n"
                                 "EndSection\n");
+            length = strlen (filebuf);
             g_clear_error (error);
 	} else {
             g_prefix_error (error, "Unable to read '%s':", parser->filename);
@@ -525,6 +573,8 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 	}
     }
 
+    PROBE3 (xorg_parse__start, PROBE_REQUEST_ID, parser->filename, length);
+    start = g_get_monotonic_time ();
     for (line = filebuf; *line != 0; line = newline + 1) {
         struct xorg_confd_line_entry *entry = NULL;
         GMatchInfo *match_info = NULL;
@@ -538,43 +588,43 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 
    if (!finished) {
 	  if (g_regex_match (xorg_confd_line_comment_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as comment", line);
+            TRACE ("Parsed line '%s' as comment", line);
             entry->type = XORG_CONFD_LINE_TYPE_COMMENT;
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_section_input_class_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as InputClass section", line);
+            TRACE ("Parsed line '%s' as InputClass section", line);
 	    if (in_xkb_section) goto parse_stop; // no way to recover
             in_section = TRUE;
             entry->type = XORG_CONFD_LINE_TYPE_SECTION_INPUT_CLASS;
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_end_section_re, line, 0, &match_info)) {
-            g_debug ("Parsed line '%s' as end of section", line);
+            TRACE ("Parsed line '%s' as end of section", line);
 	    in_section = FALSE;
 	    finished = in_xkb_section;
 	    in_xkb_section=FALSE;
             entry->type = XORG_CONFD_LINE_TYPE_END_SECTION;
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_match_is_keyboard_re, line, 0, &match_info) && in_section) {
-            g_debug ("Parsed line '%s' as MatchIsKeyboard declaration", line);
+            TRACE ("Parsed line '%s' as MatchIsKeyboard declaration", line);
             entry->type = XORG_CONFD_LINE_TYPE_MATCH_IS_KEYBOARD;
             in_xkb_section = TRUE;
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_layout_re, line, 0, &match_info) && in_section) {
-            g_debug ("Parsed line '%s' as XkbLayout option", line);
+            TRACE ("Parsed line '%s' as XkbLayout option", line);
             entry->type = XORG_CONFD_LINE_TYPE_XKB_LAYOUT;
             entry->value = g_match_info_fetch (match_info, 2);
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_model_re, line, 0, &match_info) && in_section) {
-            g_debug ("Parsed line '%s' as XkbModel option", line);
+            TRACE ("Parsed line '%s' as XkbModel option", line);
             entry->type = XORG_CONFD_LINE_TYPE_XKB_MODEL;
             entry->value = g_match_info_fetch (match_info, 2);
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_variant_re, line, 0, &match_info) && in_section) {
-            g_debug ("Parsed line '%s' as XkbVariant option", line);
+            TRACE ("Parsed line '%s' as XkbVariant option", line);
             entry->type = XORG_CONFD_LINE_TYPE_XKB_VARIANT;
             entry->value = g_match_info_fetch (match_info, 2);
           } else if (_g_match_info_clear (&match_info) && g_regex_match (xorg_confd_line_xkb_options_re, line, 0, &match_info) && in_section) {
-            g_debug ("Parsed line '%s' as XkbOptions option", line);
+            TRACE ("Parsed line '%s' as XkbOptions option", line);
             entry->type = XORG_CONFD_LINE_TYPE_XKB_OPTIONS;
             entry->value = g_match_info_fetch (match_info, 2);
           }
 
         if (entry->type == XORG_CONFD_LINE_TYPE_UNKNOWN)
-            g_debug ("Parsing line '%s' as unknown", line);
+            TRACE ("Parsing line '%s' as unknown", line);
 
         _g_match_info_clear (&match_info);
 
@@ -603,9 +653,12 @@ xorg_confd_parser_new (GFile *xorg_confd_file,
 
     parser->line_list = g_list_reverse (parser->line_list);
     g_free (filebuf);
+    stats_stage_add (STATS_STAGE_PARSE, start);
+    PROBE3 (xorg_parse__done, PROBE_REQUEST_ID, parser->filename, TRUE);
     return parser;
 
   parse_fail:
+    PROBE3 (xorg_parse__done, PROBE_REQUEST_ID, parser->filename, FALSE);
     g_propagate_error (error,
                        g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
                                    "Unable to parse '%s'", parser->filename));
@@ -773,511 +826,2484 @@ xorg_confd_parser_set_xkb (struct xorg_confd_parser *parser,
 }
 
 static gboolean
-xorg_confd_parser_save (const struct xorg_confd_parser *parser,
-                        GError **error)
+xorg_confd_parser_stage (const struct xorg_confd_parser *parser,
+                         FileTransaction *trans,
+                         GError **error)
 {
-    gboolean ret = FALSE;
+    gboolean ret;
     GList *curr = NULL;
-    GFileOutputStream *os = NULL;
-    gchar *dirname = NULL;
+    GString *contents = NULL;
+    gint64 start = g_get_monotonic_time ();
 
     g_assert (parser != NULL && parser->file != NULL && parser->filename != NULL);
-    dirname = g_path_get_dirname (parser->filename);
-    if (g_mkdir_with_parents (dirname, 0755) == -1) {
-        g_set_error (error,
-                     G_FILE_ERROR,
-                     g_file_error_from_errno (errno),
-                     "Could not create directory '%s': %s",
-                     dirname,
-                     strerror (errno)
-                    );
-        goto out;
-        }
-
-    if ((os = g_file_replace (parser->file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error)) == NULL) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        goto out;
-    }
 
+    contents = g_string_new (NULL);
     for (curr = parser->line_list; curr != NULL; curr = curr->next) {
         struct xorg_confd_line_entry *entry = (struct xorg_confd_line_entry *) curr->data;
-        gsize written;
-
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), entry->string, strlen (entry->string), &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
-        }
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), "\n", 1, &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
-        }
-    }
 
-    if (!g_output_stream_close (G_OUTPUT_STREAM (os), NULL, error)) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        g_output_stream_close (G_OUTPUT_STREAM (os), NULL, NULL);
-        goto out;
+        g_string_append (contents, entry->string);
+        g_string_append_c (contents, '\n');
     }
-    ret = TRUE;
+    stats_stage_add (STATS_STAGE_SERIALIZE, start);
 
-  out:
-    g_free (dirname);
-    if (os)
-        g_object_unref (os);
+    ret = file_transaction_stage (trans, parser->file, contents->str, contents->len, error);
+    g_string_free (contents, TRUE);
     return ret;
 }
 
-/* End of trivial /etc/X11/xorg.conf.d/30-keyboard.conf parser */
-
 static gboolean
-locale_name_is_valid (gchar *name)
+xorg_confd_parser_save (const struct xorg_confd_parser *parser,
+                        GError **error)
 {
-    return g_regex_match_simple ("^[a-zA-Z0-9_.@-]*$", name, G_REGEX_MULTILINE, 0);
+    gboolean ret = FALSE;
+    FileTransaction *trans;
+
+    PROBE2 (xorg_save__start, PROBE_REQUEST_ID, parser->filename);
+    trans = file_transaction_new ();
+    if (xorg_confd_parser_stage (parser, trans, error) &&
+        file_transaction_commit (trans, error))
+        ret = TRUE;
+    file_transaction_free (trans);
+    PROBE3 (xorg_save__done, PROBE_REQUEST_ID, parser->filename, ret);
+    return ret;
 }
 
-struct invoked_locale {
-    GDBusMethodInvocation *invocation;
-    gchar **locale; /* newly allocated */
+/* End of trivial /etc/X11/xorg.conf.d/30-keyboard.conf parser */
+
+/*
+  Requests are prepared while polkit is asked for an authorization: the
+  settings files are parsed, the keyboard model map is looked up, and the
+  new settings are computed. Nothing is written before the authorization
+  is granted, and errors found while preparing are only reported then,
+  so that an unauthorized caller learns nothing. Since another request
+  may have rewritten the files meanwhile, a stamp of each file read is
+  taken before parsing it, and the preparation is done again if a stamp
+  does not match anymore once the request is authorized.
+*/
+
+struct file_stamp {
+    GFile *file;       /* NULL if the stamp is unused, otherwise a reference */
+    gboolean exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
 };
 
 static void
-invoked_locale_free (struct invoked_locale *data)
+file_stamp_clear (struct file_stamp *stamp)
 {
-    if (data == NULL)
-        return;
-    g_strfreev (data->locale);
-    g_free (data);
+    g_clear_object (&stamp->file);
+    memset (stamp, 0, sizeof (struct file_stamp));
 }
 
 static void
-on_handle_set_locale_authorized_cb (GObject *source_object,
-                                    GAsyncResult *res,
-                                    gpointer user_data)
+file_stamps_clear (struct file_stamp *stamps,
+                   guint n_stamps)
 {
-    GError *err = NULL;
-    struct invoked_locale *data;
-    gchar **loc, **var, **val, **locale_values = NULL;
-    ShellParser *locale_file_parsed = NULL;
+    guint i;
 
-    data = (struct invoked_locale *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
-    }
+    for (i = 0; i < n_stamps; i++)
+        file_stamp_clear (&stamps[i]);
+}
 
-    G_LOCK (locale);
-    locale_values = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
-    /* Don't allow unknown locale variables or invalid values */
-    if (data->locale != NULL) {
-        for (loc = data->locale; *loc != NULL; loc++) {
-            gboolean found = FALSE;
-            for (val = locale_values, var = locale_variables; *var != NULL; val++, var++) {
-                size_t varlen;
-                gchar *unquoted = NULL;
-
-                varlen = strlen (*var);
-                if (g_str_has_prefix (*loc, *var) && (*loc)[varlen] == '=' &&
-                    (unquoted = g_shell_unquote (*loc + varlen + 1, NULL)) != NULL &&
-                    locale_name_is_valid (unquoted)) {
-                    found = TRUE;
-                    if (*val != NULL)
-                        g_free (*val);
-                    *val = unquoted;
-                } else
-                    g_free (unquoted);
-            }
-            if (!found) {
-                g_dbus_method_invocation_return_dbus_error (data->invocation, DBUS_ERROR_INVALID_ARGS,
-                                                            "Invalid locale variable name or value");
-                goto unlock;
-            }
-        }
+/* @stamp must be cleared, or taken before */
+static void
+file_stamp_take (struct file_stamp *stamp,
+                 GFile *file)
+{
+    gchar *filename;
+    struct stat st;
+
+    file_stamp_clear (stamp);
+    stamp->file = g_object_ref (file);
+    filename = g_file_get_path (file);
+    if (g_stat (filename, &st) == 0) {
+        stamp->exists = TRUE;
+        stamp->dev = st.st_dev;
+        stamp->ino = st.st_ino;
+        stamp->size = st.st_size;
+        stamp->mtime = st.st_mtim;
     }
+    g_free (filename);
+}
 
-    if ((locale_file_parsed = shell_parser_new (locale_file, &err)) == NULL) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto unlock;
-    }
+static gboolean
+file_stamp_equal (const struct file_stamp *a,
+                  const struct file_stamp *b)
+{
+    return a->exists == b->exists &&
+           a->dev == b->dev &&
+           a->ino == b->ino &&
+           a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
 
-    if (shell_parser_is_empty (locale_file_parsed)) {
-        /* Simply write the new env file */
-        shell_parser_free (locale_file_parsed);
-        if ((locale_file_parsed = shell_parser_new_from_string (locale_file, "# Configuration file for eselect\n# This file has been automatically generated\n", &err)) == NULL) {
-            g_dbus_method_invocation_return_gerror (data->invocation, err);
-            goto unlock;
-        }
-    }
+/*
+  The settings files may also have been replaced by other ones, when the
+  configuration was read again: the stamps of a request prepared before
+  then hold the previous GFile, which is not current anymore.
+*/
+static gboolean
+file_is_current (GFile *file)
+{
+    return file == locale_file || file == keymaps_file ||
+           file == x11_file || file == kbd_model_map_file;
+}
 
-    for (val = locale_values, var = locale_variables; *var != NULL; val++, var++) {
-        if (*val == NULL)
-            shell_parser_clear_variable (locale_file_parsed, *var);
-        else
-            shell_parser_set_variable (locale_file_parsed, *var, *val, TRUE);
-    }
+static gboolean
+file_stamps_are_current (const struct file_stamp *stamps,
+                         guint n_stamps)
+{
+    guint i;
 
-    if (!shell_parser_save (locale_file_parsed, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto unlock;
-    }
+    for (i = 0; i < n_stamps; i++) {
+        struct file_stamp current = { 0 };
+        gboolean equal;
 
-    g_strfreev (locale);
-    locale = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
-    loc = locale;
-    for (val = locale_values, var = locale_variables; *var != NULL; val++, var++) {
-        if (*val != NULL) {
-            *loc = g_strdup_printf ("%s=%s", *var, *val);
-            loc++;
+        if (stamps[i].file == NULL)
+            continue;
+        if (!file_is_current (stamps[i].file)) {
+            g_debug ("Settings files changed while authorizing, preparing again");
+            stats_counter_inc (STATS_PREPARED_STALE);
+            return FALSE;
+        }
+        file_stamp_take (&current, stamps[i].file);
+        equal = file_stamp_equal (&current, &stamps[i]);
+        file_stamp_clear (&current);
+        if (!equal) {
+            gchar *filename = g_file_get_path (stamps[i].file);
+
+            g_debug ("'%s' changed while authorizing, preparing again", filename);
+            g_free (filename);
+            stats_counter_inc (STATS_PREPARED_STALE);
+            return FALSE;
         }
     }
+    stats_counter_inc (STATS_PREPARED_REUSED);
+    return TRUE;
+}
 
-    blocaled_locale1_set_locale (locale1, (const gchar * const *) locale);
-  //finish: (not used right now, but keep in case we add other codepaths)
-    blocaled_locale1_complete_set_locale (locale1, data->invocation);
+/*
+  Perfect hash of the locale variable names: (length + 4th character +
+  5th character) modulo 32 is different for each of them. The table gives
+  the index in locale_variables for each hash value, or -1. It has to be
+  recomputed if locale_variables is changed; localed_init checks that it
+  matches.
+*/
 
-  unlock:
-    G_UNLOCK (locale);
+static const gint8 locale_variable_slots[32] = {
+    11, -1, -1, -1,  3, 10, -1,  5, -1, -1, -1,  0, -1,  2, -1,  9,
+    -1, -1, -1, -1, -1, -1,  8, -1, -1,  7, -1, -1,  4,  6, 12,  1
+};
 
-  out:
-    shell_parser_free (locale_file_parsed);
-    /* g_strfreev (locale_values) will leak, since it stops at first NULL value */
-    if ( locale_values != NULL ) {
-        for (val = locale_values, var = locale_variables; *var != NULL; val++, var++)
-            g_free (*val);
-        g_free (locale_values);
-    }
-    invoked_locale_free (data);
-    if (err != NULL)
-        g_error_free (err);
+/*
+ * locale_variable_index:
+ * @name: a variable name, not necessarily nul terminated
+ * @len: the length of @name
+ *
+ * Returns: the index of @name in locale_variables, or -1 if @name is not
+ * a locale variable
+ */
+
+static gint
+locale_variable_index (const gchar *name,
+                       gsize len)
+{
+    gint index;
+
+    if (len < 4)
+        return -1;
+    index = locale_variable_slots[(len + (guchar) name[3] + (len > 4 ? (guchar) name[4] : 0)) & 31];
+    if (index < 0 || strncmp (name, locale_variables[index], len) || locale_variables[index][len] != '\0')
+        return -1;
+    return index;
 }
 
+/* Characters allowed in a locale name, [a-zA-Z0-9_.@-], as a bitmap */
+static const guint32 locale_name_chars[8] = {
+    0x00000000, 0x03ff6000, 0x87ffffff, 0x07fffffe, 0, 0, 0, 0
+};
+
 static gboolean
-on_handle_set_locale (BLocaledLocale1 *locale1,
-                      GDBusMethodInvocation *invocation,
-                      const gchar * const *_locale,
-                      const gboolean user_interaction,
-                      gpointer user_data)
+locale_name_is_valid (const gchar *name)
 {
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    SERVICE_NAME " is in read-only mode");
-    else {
-        struct invoked_locale *data;
-        data = g_new0 (struct invoked_locale, 1);
-        data->invocation = invocation;
-        data->locale = g_strdupv ((gchar**)_locale);
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-locale", user_interaction, on_handle_set_locale_authorized_cb, data);
-    }
+    const guchar *p;
 
+    for (p = (const guchar *) name; *p != '\0'; p++)
+        if (!(locale_name_chars[*p >> 5] & (1U << (*p & 31))))
+            return FALSE;
     return TRUE;
 }
 
-struct invoked_vconsole_keyboard {
-    GDBusMethodInvocation *invocation;
-    gchar *vconsole_keymap; /* newly allocated */
-    gchar *vconsole_keymap_toggle; /* newly allocated */
-    gboolean convert;
-};
+/*
+ * locale_value_unquote:
+ * @value: a locale value, as found in a SetLocale request
+ *
+ * Returns: the unquoted value, newly allocated, or %NULL if it is not a
+ * valid locale name. Most values are not quoted, and are just copied.
+ */
 
-static void
-invoked_vconsole_keyboard_free (struct invoked_vconsole_keyboard *data)
+static gchar *
+locale_value_unquote (const gchar *value)
 {
-    if (data == NULL)
-        return;
-    g_free (data->vconsole_keymap);
-    g_free (data->vconsole_keymap_toggle);
-    g_free (data);
+    gchar *unquoted;
+
+    if (locale_name_is_valid (value))
+        return g_strdup (value);
+    if (strpbrk (value, "'\"\\") == NULL ||
+        (unquoted = g_shell_unquote (value, NULL)) == NULL)
+        return NULL;
+    if (locale_name_is_valid (unquoted))
+        return unquoted;
+    g_free (unquoted);
+    return NULL;
 }
 
-static void
-on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
-                                               GAsyncResult *res,
-                                               gpointer user_data)
+/* A keymap is a file name for loadkeys, looked up in the keymap
+   directories. Empty means unset. */
+static gboolean
+keymap_name_is_valid (const gchar *name)
 {
-    GError *err = NULL;
-    struct invoked_vconsole_keyboard *data;
-    GList *kbd_model_map = NULL;
-    struct kbd_model_map_entry *best_entry = NULL;
-    struct xorg_confd_parser *x11_parser = NULL;
+    const gchar *p;
+
+    if (name == NULL)
+        return FALSE;
+    if (*name == '\0')
+        return TRUE;
+    if (strlen (name) >= 128 || !strcmp (name, ".") || !strcmp (name, ".."))
+        return FALSE;
+    for (p = name; *p != '\0'; p++)
+        if (*p == '/' || *p == '\\' || *p == '"' || *p == '\'' || g_ascii_iscntrl (*p))
+            return FALSE;
+    return TRUE;
+}
 
-    data = (struct invoked_vconsole_keyboard *) user_data;
-    if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto out;
-    }
+/* X11 values are written between double quotes in xorg.conf */
+static gboolean
+x11_value_is_valid (const gchar *value)
+{
+    const gchar *p;
 
-    G_LOCK (keymaps);
-    if (data->convert) {
-        GList *cur;
+    if (value == NULL)
+        return FALSE;
+    for (p = value; *p != '\0'; p++)
+        if (*p == '"' || g_ascii_iscntrl (*p))
+            return FALSE;
+    return TRUE;
+}
 
-        G_LOCK (xorg_conf);
-        kbd_model_map = kbd_model_map_load (&err);
-        if (err != NULL) {
-            g_dbus_method_invocation_return_gerror (data->invocation, err);
-            goto unlock;
-        }
+/* In strict mode, the keymaps must be installed. Empty means unset. */
+static gboolean
+keymap_is_known (const gchar *name)
+{
+    return !strict_keyboard || *name == '\0' || keymap_index_contains (name);
+}
 
-        for (cur = kbd_model_map; cur->next != NULL; cur = cur->next) {
-            struct kbd_model_map_entry *cur_entry = NULL;
-            cur_entry = (struct kbd_model_map_entry *) cur->data;
-            if (kbd_model_map_entry_matches_vconsole (cur_entry, data->vconsole_keymap)) {
-                best_entry = cur_entry;
-                break;
-            }
-        }
-    }
+/*
+ * x11_keyboard_is_known:
+ * @layout: comma separated list of layouts
+ * @model: a model
+ * @variant: comma separated list of variants, one per layout, possibly
+ * empty
+ * @options: comma separated list of options
+ *
+ * In strict mode, check the values against the xkb rules.
+ *
+ * Returns: %TRUE if all the values are known, or empty
+ */
 
-    if (!shell_parser_set_and_save (keymaps_file, &err,
-          keymap_var, NULL, data->vconsole_keymap,
-          toggle_var, NULL, data->vconsole_keymap_toggle,
-          NULL)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
-        goto unlock;
-    }
+static gboolean
+x11_keyboard_is_known (const gchar *layout,
+                       const gchar *model,
+                       const gchar *variant,
+                       const gchar *options)
+{
+    gchar **layouts = NULL, **variants = NULL, **opts = NULL;
+    gboolean ret = FALSE;
+    guint i, n_variants;
 
-    g_free (vconsole_keymap);
-    g_free (vconsole_keymap_toggle);
-    vconsole_keymap = g_strdup (data->vconsole_keymap);
-    vconsole_keymap_toggle = g_strdup (data->vconsole_keymap_toggle);
-    blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
-    blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
+    if (!strict_keyboard)
+        return TRUE;
 
-    if (data->convert) {
-        if (best_entry == NULL) {
-            gchar *filename, *message;
-            filename = g_file_get_path (kbd_model_map_file);
-            message = g_strdup_printf ("Failed to find conversion entry for console keymap '%s' in '%s'", data->vconsole_keymap, filename);
-	    g_dbus_method_invocation_return_dbus_error (
-			    data->invocation,
-			    DBUS_ERROR_FAILED,
-			    message);
-            g_free (filename);
-            g_free (message);
-            goto unlock;
-        } else {
-            unsigned int failure_score = 0;
-
-            kbd_model_map_entry_matches_x11 (best_entry, x11_layout, x11_model, x11_variant, x11_options, &failure_score);
-            if (failure_score > 0) {
-                /* The xkb data has changed, so we want to update it */
-                x11_parser = xorg_confd_parser_new (x11_file, TRUE, &err);
-
-                if (x11_parser == NULL) {
-                    g_dbus_method_invocation_return_gerror (data->invocation, err);
-                    goto unlock;
-                }
-                xorg_confd_parser_set_xkb (x11_parser, best_entry->x11_layout, best_entry->x11_model, best_entry->x11_variant, best_entry->x11_options);
-                if (!xorg_confd_parser_save (x11_parser, &err)) {
-                    g_dbus_method_invocation_return_gerror (data->invocation, err);
-                    goto unlock;
-                }
-                g_free (x11_layout);
-                g_free (x11_model);
-                g_free (x11_variant);
-                g_free (x11_options);
-                x11_layout = g_strdup (best_entry->x11_layout);
-                x11_model = g_strdup (best_entry->x11_model);
-                x11_variant = g_strdup (best_entry->x11_variant);
-                x11_options = g_strdup (best_entry->x11_options);
-                blocaled_locale1_set_x11_layout (locale1, x11_layout);
-                blocaled_locale1_set_x11_model (locale1, x11_model);
-                blocaled_locale1_set_x11_variant (locale1, x11_variant);
-                blocaled_locale1_set_x11_options (locale1, x11_options);
-            }
+    if (*model != '\0' && !xkb_index_contains (XKB_INDEX_MODEL, model))
+        goto out;
+
+    layouts = g_strsplit (layout, ",", -1);
+    variants = g_strsplit (variant, ",", -1);
+    n_variants = g_strv_length (variants);
+    if (n_variants > g_strv_length (layouts))
+        goto out;
+    for (i = 0; layouts[i] != NULL; i++) {
+        const gchar *var = i < n_variants ? variants[i] : "";
+
+        if (*layouts[i] == '\0') {
+            if (*var != '\0')
+                goto out;
+        } else if (!xkb_index_contains (XKB_INDEX_LAYOUT, layouts[i])) {
+            goto out;
+        } else if (*var != '\0') {
+            gchar *key = g_strdup_printf ("%s(%s)", layouts[i], var);
+            gboolean known = xkb_index_contains (XKB_INDEX_VARIANT, key);
+
+            g_free (key);
+            if (!known)
+                goto out;
         }
     }
 
-  //finish: (not used right now, but keep in case we add other codepaths)
-    blocaled_locale1_complete_set_vconsole_keyboard (locale1, data->invocation);
-
-  unlock:
-    if (data->convert)
-        G_UNLOCK (xorg_conf);
-    G_UNLOCK (keymaps);
+    opts = g_strsplit (options, ",", -1);
+    for (i = 0; opts[i] != NULL; i++)
+        if (*opts[i] != '\0' && !xkb_index_contains (XKB_INDEX_OPTION, opts[i]))
+            goto out;
+    ret = TRUE;
 
   out:
-    if (kbd_model_map != NULL)
-        g_list_free_full (kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
-    xorg_confd_parser_free (x11_parser);
-    invoked_vconsole_keyboard_free (data);
-    if (err != NULL)
-        g_error_free (err);
+    g_strfreev (layouts);
+    g_strfreev (variants);
+    g_strfreev (opts);
+    return ret;
 }
 
+/*
+  With an idle timeout, blocaled exits when no method call has been
+  received for that time, and none is being processed. It is started
+  again by D-Bus activation when needed. Each method handler starts by
+  tracking its invocation, which is done when it is freed, that is once
+  it has been replied to.
+
+  The name is released before exiting, so that a call coming after that
+  starts a new instance instead of being lost. The calls the bus routed
+  to us before are already queued once g_bus_unown_name has returned, so
+  they are answered first, from low priority idle callbacks.
+*/
+
+static gboolean idle_exiting = FALSE;
+static guint idle_exit_id = 0;
+
 static gboolean
-on_handle_set_vconsole_keyboard (BLocaledLocale1 *locale1,
-                                 GDBusMethodInvocation *invocation,
-                                 const gchar *keymap,
-                                 const gchar *keymap_toggle,
-                                 const gboolean convert,
-                                 const gboolean user_interaction,
-                                 gpointer user_data)
+on_idle_exit (gpointer user_data)
 {
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    SERVICE_NAME " is in read-only mode");
-    else {
-        struct invoked_vconsole_keyboard *data;
-        data = g_new0 (struct invoked_vconsole_keyboard, 1);
-        data->invocation = invocation;
-        data->vconsole_keymap = g_strdup (keymap);
-        data->vconsole_keymap_toggle = g_strdup (keymap_toggle);
-        data->convert = convert;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_vconsole_keyboard_authorized_cb, data);
-    }
-
-    return TRUE;
+    idle_exit_id = 0;
+    if (requests_in_flight == 0)
+        localed_exit (0);
+    return G_SOURCE_REMOVE;
 }
 
-struct invoked_x11_keyboard {
-    GDBusMethodInvocation *invocation;
-    gchar *x11_layout; /* newly allocated */
-    gchar *x11_model; /* newly allocated */
-    gchar *x11_variant; /* newly allocated */
-    gchar *x11_options; /* newly allocated */
-    gboolean convert;
-};
+static gboolean
+on_idle_timeout (gpointer user_data)
+{
+    idle_timeout_id = 0;
+    g_debug ("Idle for %u seconds, exiting", idle_timeout);
+    idle_exiting = TRUE;
+    g_bus_unown_name (bus_id);
+    bus_id = 0;
+    idle_exit_id = g_idle_add_full (G_PRIORITY_LOW, on_idle_exit, NULL, NULL);
+    return G_SOURCE_REMOVE;
+}
 
 static void
-invoked_x11_keyboard_free (struct invoked_x11_keyboard *data)
+idle_timer_restart (void)
 {
-    if (data == NULL)
-        return;
-    g_free (data->x11_layout);
-    g_free (data->x11_model);
-    g_free (data->x11_variant);
-    g_free (data->x11_options);
+    if (idle_timeout_id != 0)
+        g_source_remove (idle_timeout_id);
+    idle_timeout_id = 0;
+    if (idle_exiting) {
+        /* Exit once the queued calls are answered */
+        if (requests_in_flight == 0 && idle_exit_id == 0)
+            idle_exit_id = g_idle_add_full (G_PRIORITY_LOW, on_idle_exit, NULL, NULL);
+    } else if (idle_timeout != 0 && requests_in_flight == 0)
+        idle_timeout_id = g_timeout_add_seconds (idle_timeout, on_idle_timeout, NULL);
+}
+
+/*
+  A request is also followed for the statistics, from its arrival to its
+  reply, when the invocation is finalized. Whether it failed is noted
+  by the request_return_* wrappers, which must be used instead of
+  g_dbus_method_invocation_return_*.
+*/
+
+struct request {
+    guint64 id;        /* for the probes */
+    StatsMethod method;
+    gint64 start;
+    gboolean failed;
+};
+
+static guint64 request_last_id = 0;
+
+static void
+on_request_done (gpointer user_data,
+                 GObject *invocation)
+{
+    struct request *request = (struct request *) user_data;
+
+    PROBE3 (request__done, request->id, request->failed, g_get_monotonic_time () - request->start);
+    stats_request_add (request->method, request->start, request->failed);
+    g_free (request);
+    requests_in_flight--;
+    stats_gauge_add (STATS_GAUGE_REQUESTS_IN_FLIGHT, -1);
+    idle_timer_restart ();
+}
+
+static void
+request_track (GDBusMethodInvocation *invocation)
+{
+    struct request *request = g_new0 (struct request, 1);
+
+    request->id = ++request_last_id;
+    request->method = stats_method_from_name (g_dbus_method_invocation_get_method_name (invocation));
+    request->start = g_get_monotonic_time ();
+    PROBE2 (request__start, request->id, g_dbus_method_invocation_get_method_name (invocation));
+    g_object_set_data (G_OBJECT (invocation), "blocaled-request", request);
+    requests_in_flight++;
+    stats_gauge_add (STATS_GAUGE_REQUESTS_IN_FLIGHT, 1);
+    g_object_weak_ref (G_OBJECT (invocation), on_request_done, request);
+    idle_timer_restart ();
+}
+
+/* Only used by the probes, which may not be compiled in */
+static inline guint64
+request_get_id (GDBusMethodInvocation *invocation)
+{
+    struct request *request = g_object_get_data (G_OBJECT (invocation), "blocaled-request");
+
+    return request != NULL ? request->id : 0;
+}
+
+static void
+request_mark_failed (GDBusMethodInvocation *invocation)
+{
+    struct request *request = g_object_get_data (G_OBJECT (invocation), "blocaled-request");
+
+    if (request != NULL)
+        request->failed = TRUE;
+}
+
+/* The arguments are valid, polkit is asked next */
+static void
+request_validated (GDBusMethodInvocation *invocation)
+{
+    struct request *request = g_object_get_data (G_OBJECT (invocation), "blocaled-request");
+
+    if (request != NULL)
+        stats_stage_add (STATS_STAGE_VALIDATION, request->start);
+}
+
+static void
+request_return_gerror (GDBusMethodInvocation *invocation,
+                       const GError *error)
+{
+    request_mark_failed (invocation);
+    g_dbus_method_invocation_return_gerror (invocation, error);
+}
+
+static void
+request_return_dbus_error (GDBusMethodInvocation *invocation,
+                           const gchar *error_name,
+                           const gchar *error_message)
+{
+    request_mark_failed (invocation);
+    g_dbus_method_invocation_return_dbus_error (invocation, error_name, error_message);
+}
+
+/*
+  Arguments are validated as soon as a request arrives, before asking
+  polkit: they do not depend on the state of the system, so rejecting
+  them early does not tell anything to an unauthorized caller, and saves
+  an authorization check, and maybe a password prompt.
+*/
+
+static void
+reject_invalid_args (GDBusMethodInvocation *invocation,
+                     const gchar *message)
+{
+    stats_counter_inc (STATS_REJECTED_INVALID_ARGS);
+    request_return_dbus_error (invocation, DBUS_ERROR_INVALID_ARGS, message);
+}
+
+struct invoked_locale {
+    GDBusMethodInvocation *invocation;
+    gchar **locale; /* newly allocated */
+    gchar **values; /* one per locale_variables entry, NULL if unset */
+    gboolean partial; /* if set, only the touched variables are changed */
+    gboolean touched[G_N_ELEMENTS (locale_variables)];
+
+    /* Prepared while authorizing */
+    struct file_stamp stamps[1];
+    ShellParser *parser;
+    GError *error;
+};
+
+static void
+invoked_locale_reset (struct invoked_locale *data)
+{
+    file_stamps_clear (data->stamps, G_N_ELEMENTS (data->stamps));
+    g_clear_pointer (&data->parser, shell_parser_free);
+    g_clear_error (&data->error);
+}
+
+static void
+invoked_locale_free (struct invoked_locale *data)
+{
+    gchar **val, **var;
+
+    if (data == NULL)
+        return;
+    invoked_locale_reset (data);
+    /* g_strfreev (data->values) would leak, since it stops at first NULL value */
+    if (data->values != NULL) {
+        for (val = data->values, var = locale_variables; *var != NULL; val++, var++)
+            g_free (*val);
+        g_free (data->values);
+    }
+    g_strfreev (data->locale);
     g_free (data);
 }
 
+/*
+ * set_locale_validate:
+ * @data: the request
+ *
+ * Check the requested locale, and split it into @data->values. In strict
+ * mode, the locales must also be installed.
+ *
+ * Returns: %NULL if the request is valid, otherwise the error message
+ */
+
+static const gchar *
+set_locale_validate (struct invoked_locale *data)
+{
+    gchar **loc;
+
+    data->values = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
+    /* Don't allow unknown locale variables or invalid values */
+    if (data->locale != NULL) {
+        for (loc = data->locale; *loc != NULL; loc++) {
+            const gchar *equal = strchr (*loc, '=');
+            gchar *value;
+            gint index;
+
+            if (equal == NULL ||
+                (index = locale_variable_index (*loc, equal - *loc)) < 0 ||
+                (value = locale_value_unquote (equal + 1)) == NULL)
+                return "Invalid locale variable name or value";
+            g_free (data->values[index]);
+            data->values[index] = value;
+            data->touched[index] = TRUE;
+            if (strict_locale && !locale_index_contains (value))
+                return "Locale not installed";
+        }
+    }
+    return NULL;
+}
+
+/*
+  A request asking for the current settings is completed at once, without
+  authorization nor I/O, like systemd-localed does. The requested values
+  are compared after being split and unquoted, so the order of the
+  locale list and the quoting do not matter.
+*/
+
+/* An unset setting is the same as an empty one */
+static gboolean
+setting_equal (const gchar *requested,
+               const gchar *current)
+{
+    return !g_strcmp0 (requested != NULL ? requested : "",
+                       current != NULL ? current : "");
+}
+
+/*
+  Replace *@current by @value if they differ, taking ownership of @value.
+  As with setting_equal, unset and empty are the same: the files read
+  back after blocaled wrote an empty value have it unset. An unset
+  @value is stored as an empty one. Returns whether the property has to
+  be updated.
+*/
+static gboolean
+setting_update (gchar **current,
+                gchar *value,
+                const gchar *property)
+{
+    if (setting_equal (value, *current)) {
+        g_free (value);
+        return FALSE;
+    }
+    g_debug ("%s changed from '%s' to '%s'", property, *current ? *current : "", value ? value : "");
+    g_free (*current);
+    *current = value != NULL ? value : g_strdup ("");
+    return TRUE;
+}
+
 static void
-on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
-                                          GAsyncResult *res,
-                                          gpointer user_data)
+complete_noop (const gchar *method)
+{
+    stats_counter_inc (STATS_NOOP_REQUESTS);
+    g_debug ("%s: nothing to change", method);
+}
+
+/*
+ * set_locale_is_noop:
+ * @data: the validated request
+ *
+ * Must be called with the locale lock held.
+ *
+ * Returns: %TRUE if @data->values are the current locale settings
+ */
+
+/*
+ * locale_get_values:
+ * @current: (out): one per locale_variables entry, NULL if unset. The
+ * values belong to the current locale.
+ *
+ * Must be called with the locale lock held.
+ */
+
+static void
+locale_get_values (const gchar **current)
+{
+    gchar **loc;
+
+    memset (current, 0, G_N_ELEMENTS (locale_variables) * sizeof (gchar *));
+    for (loc = locale; loc != NULL && *loc != NULL; loc++) {
+        const gchar *equal = strchr (*loc, '=');
+        gint index;
+
+        if (equal != NULL && (index = locale_variable_index (*loc, equal - *loc)) >= 0)
+            current[index] = equal + 1;
+    }
+}
+
+static gboolean
+set_locale_is_noop (const struct invoked_locale *data)
+{
+    const gchar *current[G_N_ELEMENTS (locale_variables)];
+    guint i;
+
+    locale_get_values (current);
+    for (i = 0; locale_variables[i] != NULL; i++)
+        if ((!data->partial || data->touched[i]) && g_strcmp0 (data->values[i], current[i]))
+            return FALSE;
+    return TRUE;
+}
+
+/*
+ * set_locale_prepare:
+ * @data: the validated request
+ *
+ * Compute the new content of the locale file. On failure, @data->error
+ * is set. Must be called with the locale lock held.
+ */
+
+static void
+set_locale_prepare (struct invoked_locale *data)
+{
+    gchar **var, **val;
+    gboolean *touched;
+
+    file_stamp_take (&data->stamps[0], locale_file);
+
+    /* The other variables keep their current value, which may have
+       changed since the request was received */
+    if (data->partial) {
+        const gchar *current[G_N_ELEMENTS (locale_variables)];
+        guint i;
+
+        locale_get_values (current);
+        for (i = 0; locale_variables[i] != NULL; i++)
+            if (!data->touched[i]) {
+                g_free (data->values[i]);
+                data->values[i] = g_strdup (current[i]);
+            }
+    }
+
+    if ((data->parser = shell_parser_new (locale_file, &data->error)) == NULL)
+        return;
+
+    if (shell_parser_is_empty (data->parser)) {
+        /* Simply write the new env file */
+        shell_parser_free (data->parser);
+        if ((data->parser = shell_parser_new_from_string (locale_file, "# Configuration file for eselect\n# This file has been automatically generated\n", &data->error)) == NULL)
+            return;
+    }
+
+    for (val = data->values, var = locale_variables, touched = data->touched; *var != NULL; val++, var++, touched++) {
+        if (data->partial && !*touched)
+            continue;
+        if (*val == NULL)
+            shell_parser_clear_variable (data->parser, *var);
+        else
+            shell_parser_set_variable (data->parser, *var, *val, TRUE);
+    }
+}
+
+/*
+ * locale_set_values:
+ * @values: one per locale_variables entry, NULL if unset
+ *
+ * Make @values the current locale settings, and update the Locale
+ * property. Must be called with the locale lock held.
+ */
+
+static void
+locale_set_values (gchar **values)
+{
+    gchar **loc, **var, **val;
+
+    g_strfreev (locale);
+    locale = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
+    loc = locale;
+    for (val = values, var = locale_variables; *var != NULL; val++, var++) {
+        if (*val != NULL) {
+            *loc = g_strdup_printf ("%s=%s", *var, *val);
+            loc++;
+        }
+    }
+
+    blocaled_locale1_set_locale (locale1, (const gchar * const *) locale);
+}
+
+static void
+on_handle_set_locale_authorized_cb (GObject *source_object,
+                                    GAsyncResult *res,
+                                    gpointer user_data)
 {
     GError *err = NULL;
-    struct invoked_x11_keyboard *data;
-    GList *kbd_model_map = NULL;
-    struct kbd_model_map_entry *best_entry = NULL;
-    unsigned int best_failure_score = UINT_MAX;
-    struct xorg_confd_parser *x11_parser = NULL;
+    struct invoked_locale *data;
 
-    data = (struct invoked_x11_keyboard *) user_data;
+    data = (struct invoked_locale *) user_data;
+    PROBE_REQUEST_SCOPE (request_get_id (data->invocation));
     if (!check_polkit_finish (res, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
+        request_return_gerror (data->invocation, err);
         goto out;
     }
 
-    G_LOCK (xorg_conf);
-    if (data->convert) {
-        GList *cur;
+    G_LOCK (locale);
+    if (!file_stamps_are_current (data->stamps, G_N_ELEMENTS (data->stamps))) {
+        invoked_locale_reset (data);
+        set_locale_prepare (data);
+    }
+    if (data->error != NULL) {
+        request_return_gerror (data->invocation, data->error);
+        goto unlock;
+    }
 
-        G_LOCK (keymaps);
-        kbd_model_map = kbd_model_map_load (&err);
-        if (err != NULL) {
-            g_dbus_method_invocation_return_gerror (data->invocation, err);
-            goto unlock;
+    if (!shell_parser_save (data->parser, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto unlock;
+    }
+
+    locale_set_values (data->values);
+  //finish: (not used right now, but keep in case we add other codepaths)
+    if (data->partial)
+        blocaled_locale1_extensions_complete_set_locale_variables (extensions, data->invocation);
+    else
+        blocaled_locale1_complete_set_locale (locale1, data->invocation);
+
+  unlock:
+    G_UNLOCK (locale);
+
+  out:
+    invoked_locale_free (data);
+    if (err != NULL)
+        g_error_free (err);
+}
+
+static gboolean
+on_handle_set_locale (BLocaledLocale1 *locale1,
+                      GDBusMethodInvocation *invocation,
+                      const gchar * const *_locale,
+                      const gboolean user_interaction,
+                      gpointer user_data)
+{
+    request_track (invocation);
+    PROBE_REQUEST_SCOPE (request_get_id (invocation));
+    settings_ensure_loaded (SETTINGS_FILE_LOCALE);
+
+    if (read_only)
+        request_return_dbus_error (invocation,
+                                   DBUS_ERROR_NOT_SUPPORTED,
+                                   SERVICE_NAME " is in read-only mode");
+    else {
+        struct invoked_locale *data;
+        const gchar *message;
+
+        data = g_new0 (struct invoked_locale, 1);
+        data->invocation = invocation;
+        data->locale = g_strdupv ((gchar**)_locale);
+        if ((message = set_locale_validate (data)) != NULL) {
+            reject_invalid_args (invocation, message);
+            invoked_locale_free (data);
+            return TRUE;
         }
+        G_LOCK (locale);
+        if (set_locale_is_noop (data)) {
+            G_UNLOCK (locale);
+            complete_noop ("SetLocale");
+            blocaled_locale1_complete_set_locale (locale1, invocation);
+            invoked_locale_free (data);
+            return TRUE;
+        }
+        G_UNLOCK (locale);
+        /* polkit answers in the main loop, so there is time to prepare */
+        request_validated (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-locale", user_interaction, on_handle_set_locale_authorized_cb, data);
+        G_LOCK (locale);
+        set_locale_prepare (data);
+        G_UNLOCK (locale);
+    }
 
-        for (cur = kbd_model_map; cur->next != NULL; cur = cur->next) {
-            struct kbd_model_map_entry *cur_entry = NULL;
-            unsigned int cur_failure_score = 0;
+    return TRUE;
+}
 
-            cur_entry = (struct kbd_model_map_entry *) cur->data;
-            if (kbd_model_map_entry_matches_x11 (cur_entry, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options, &cur_failure_score))
-                if (cur_failure_score < best_failure_score) {
-                    best_entry = cur_entry;
-                    best_failure_score = cur_failure_score;
-                }
+/*
+  SetLocaleVariables: like SetLocale, but the variables which are not
+  named in the request are left as they are, in the file and in the
+  Locale property. The current values are merged in when the file is
+  prepared, under the locale lock.
+*/
+
+static gboolean
+on_handle_set_locale_variables (BLocaledLocale1Extensions *extensions,
+                                GDBusMethodInvocation *invocation,
+                                const gchar * const *_locale,
+                                const gchar * const *unset,
+                                const gboolean user_interaction,
+                                gpointer user_data)
+{
+    request_track (invocation);
+    PROBE_REQUEST_SCOPE (request_get_id (invocation));
+    settings_ensure_loaded (SETTINGS_FILE_LOCALE);
+
+    if (read_only)
+        request_return_dbus_error (invocation,
+                                   DBUS_ERROR_NOT_SUPPORTED,
+                                   SERVICE_NAME " is in read-only mode");
+    else {
+        struct invoked_locale *data;
+        const gchar *message;
+        const gchar * const *name;
+
+        data = g_new0 (struct invoked_locale, 1);
+        data->invocation = invocation;
+        data->locale = g_strdupv ((gchar**)_locale);
+        data->partial = TRUE;
+        if ((message = set_locale_validate (data)) != NULL) {
+            reject_invalid_args (invocation, message);
+            invoked_locale_free (data);
+            return TRUE;
+        }
+        for (name = unset; name != NULL && *name != NULL; name++) {
+            gint index = locale_variable_index (*name, strlen (*name));
+
+            if (index < 0) {
+                reject_invalid_args (invocation, "Invalid locale variable name or value");
+                invoked_locale_free (data);
+                return TRUE;
+            }
+            g_clear_pointer (&data->values[index], g_free);
+            data->touched[index] = TRUE;
+        }
+        G_LOCK (locale);
+        if (set_locale_is_noop (data)) {
+            G_UNLOCK (locale);
+            complete_noop ("SetLocaleVariables");
+            blocaled_locale1_extensions_complete_set_locale_variables (extensions, invocation);
+            invoked_locale_free (data);
+            return TRUE;
         }
+        G_UNLOCK (locale);
+        request_validated (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-locale", user_interaction, on_handle_set_locale_authorized_cb, data);
+        G_LOCK (locale);
+        set_locale_prepare (data);
+        G_UNLOCK (locale);
     }
 
-    x11_parser = xorg_confd_parser_new (x11_file, TRUE, &err);
+    return TRUE;
+}
+
+struct invoked_vconsole_keyboard {
+    GDBusMethodInvocation *invocation;
+    gchar *vconsole_keymap; /* newly allocated */
+    gchar *vconsole_keymap_toggle; /* newly allocated */
+    gboolean convert;
+
+    /* Prepared while authorizing */
+    struct file_stamp stamps[3];
+    GList *kbd_model_map;
+    struct kbd_model_map_entry *best_entry;
+    ShellParser *keymaps_parser;
+    struct xorg_confd_parser *x11_parser; /* NULL if X11 is unchanged */
+    GError *error;
+};
+
+static void
+invoked_vconsole_keyboard_reset (struct invoked_vconsole_keyboard *data)
+{
+    if (data->kbd_model_map != NULL)
+        g_list_free_full (data->kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
+    data->kbd_model_map = NULL;
+    data->best_entry = NULL;
+    file_stamps_clear (data->stamps, G_N_ELEMENTS (data->stamps));
+    g_clear_pointer (&data->keymaps_parser, shell_parser_free);
+    g_clear_pointer (&data->x11_parser, xorg_confd_parser_free);
+    g_clear_error (&data->error);
+}
+
+static void
+invoked_vconsole_keyboard_free (struct invoked_vconsole_keyboard *data)
+{
+    if (data == NULL)
+        return;
+    invoked_vconsole_keyboard_reset (data);
+    g_free (data->vconsole_keymap);
+    g_free (data->vconsole_keymap_toggle);
+    g_free (data);
+}
+
+/*
+ * set_vconsole_keyboard_prepare:
+ * @data: the request
+ *
+ * Compute the new content of the keymap file, and if converting, of the
+ * X11 keyboard file. On failure, @data->error is set. Must be called with
+ * the keymaps lock held, and also the xorg_conf lock if converting.
+ */
+
+static void
+set_vconsole_keyboard_prepare (struct invoked_vconsole_keyboard *data)
+{
+    gint64 start;
+
+    file_stamp_take (&data->stamps[0], keymaps_file);
+    if (data->convert) {
+        GList *cur;
+
+        /* The X11 settings are compared to the current ones, which are
+           those of x11_file */
+        file_stamp_take (&data->stamps[1], kbd_model_map_file);
+        file_stamp_take (&data->stamps[2], x11_file);
+        PROBE2 (kbd_model_map_lookup__start, PROBE_REQUEST_ID, data->vconsole_keymap);
+        start = g_get_monotonic_time ();
+        data->kbd_model_map = kbd_model_map_load (&data->error);
+        if (data->error != NULL)
+            return;
+
+        for (cur = data->kbd_model_map; cur->next != NULL; cur = cur->next) {
+            struct kbd_model_map_entry *cur_entry = NULL;
+            cur_entry = (struct kbd_model_map_entry *) cur->data;
+            if (kbd_model_map_entry_matches_vconsole (cur_entry, data->vconsole_keymap)) {
+                data->best_entry = cur_entry;
+                break;
+            }
+        }
+        stats_stage_add (STATS_STAGE_MAP_LOOKUP, start);
+        PROBE2 (kbd_model_map_lookup__done, PROBE_REQUEST_ID, data->best_entry != NULL);
+
+        /* Fail before writing anything, so that no half-done conversion
+           is left on disk */
+        if (data->best_entry == NULL) {
+            gchar *filename;
+            filename = g_file_get_path (kbd_model_map_file);
+            g_set_error (&data->error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                         "Failed to find conversion entry for console keymap '%s' in '%s'",
+                         data->vconsole_keymap, filename);
+            g_free (filename);
+            return;
+        }
+    }
+
+    if ((data->keymaps_parser = shell_parser_new (keymaps_file, &data->error)) == NULL ||
+        !shell_parser_set_variables (data->keymaps_parser, &data->error,
+          keymap_var, NULL, data->vconsole_keymap,
+          toggle_var, NULL, data->vconsole_keymap_toggle,
+          NULL))
+        return;
+
+    if (data->convert) {
+        unsigned int failure_score = 0;
+        struct kbd_model_map_entry *best_entry = data->best_entry;
+
+        kbd_model_map_entry_matches_x11 (best_entry, x11_layout, x11_model, x11_variant, x11_options, &failure_score);
+        if (failure_score > 0) {
+            /* The xkb data has changed, so we want to update it */
+            if ((data->x11_parser = xorg_confd_parser_new (x11_file, TRUE, &data->error)) == NULL)
+                return;
+            xorg_confd_parser_set_xkb (data->x11_parser, best_entry->x11_layout, best_entry->x11_model, best_entry->x11_variant, best_entry->x11_options);
+        }
+    }
+}
+
+static void
+on_handle_set_vconsole_keyboard_authorized_cb (GObject *source_object,
+                                               GAsyncResult *res,
+                                               gpointer user_data)
+{
+    GError *err = NULL;
+    struct invoked_vconsole_keyboard *data;
+    struct kbd_model_map_entry *best_entry;
+    FileTransaction *trans = NULL;
+
+    data = (struct invoked_vconsole_keyboard *) user_data;
+    PROBE_REQUEST_SCOPE (request_get_id (data->invocation));
+    if (!check_polkit_finish (res, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto out;
+    }
+
+    G_LOCK (keymaps);
+    if (data->convert)
+        G_LOCK (xorg_conf);
+    if (!file_stamps_are_current (data->stamps, G_N_ELEMENTS (data->stamps))) {
+        invoked_vconsole_keyboard_reset (data);
+        set_vconsole_keyboard_prepare (data);
+    }
+    if (data->error != NULL) {
+        request_return_gerror (data->invocation, data->error);
+        goto unlock;
+    }
+    best_entry = data->best_entry;
+
+    /* Both files are replaced, or none */
+    trans = file_transaction_new ();
+    if (!shell_parser_stage (data->keymaps_parser, trans, &err) ||
+        (data->x11_parser != NULL && !xorg_confd_parser_stage (data->x11_parser, trans, &err)) ||
+        !file_transaction_commit (trans, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto unlock;
+    }
+
+    /* Only the properties which changed are set: with lazyload, the
+       others may never have been set in the skeleton */
+    if (setting_update (&vconsole_keymap, g_strdup (data->vconsole_keymap), "VConsoleKeymap"))
+        blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
+    if (setting_update (&vconsole_keymap_toggle, g_strdup (data->vconsole_keymap_toggle), "VConsoleKeymapToggle"))
+        blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
+
+    if (data->x11_parser != NULL) {
+        if (setting_update (&x11_layout, g_strdup (best_entry->x11_layout), "X11Layout"))
+            blocaled_locale1_set_x11_layout (locale1, x11_layout);
+        if (setting_update (&x11_model, g_strdup (best_entry->x11_model), "X11Model"))
+            blocaled_locale1_set_x11_model (locale1, x11_model);
+        if (setting_update (&x11_variant, g_strdup (best_entry->x11_variant), "X11Variant"))
+            blocaled_locale1_set_x11_variant (locale1, x11_variant);
+        if (setting_update (&x11_options, g_strdup (best_entry->x11_options), "X11Options"))
+            blocaled_locale1_set_x11_options (locale1, x11_options);
+    }
+
+  //finish: (not used right now, but keep in case we add other codepaths)
+    blocaled_locale1_complete_set_vconsole_keyboard (locale1, data->invocation);
+
+  unlock:
+    if (data->convert)
+        G_UNLOCK (xorg_conf);
+    G_UNLOCK (keymaps);
+
+  out:
+    file_transaction_free (trans);
+    invoked_vconsole_keyboard_free (data);
+    if (err != NULL)
+        g_error_free (err);
+}
+
+/* As in systemd-localed, the conversion is not checked: the X11 settings
+   are left as they are when the keymap does not change. */
+static gboolean
+set_vconsole_keyboard_is_noop (const gchar *keymap,
+                               const gchar *keymap_toggle)
+{
+    gboolean ret;
+
+    G_LOCK (keymaps);
+    ret = setting_equal (keymap, vconsole_keymap) &&
+          setting_equal (keymap_toggle, vconsole_keymap_toggle);
+    G_UNLOCK (keymaps);
+    return ret;
+}
+
+static gboolean
+on_handle_set_vconsole_keyboard (BLocaledLocale1 *locale1,
+                                 GDBusMethodInvocation *invocation,
+                                 const gchar *keymap,
+                                 const gchar *keymap_toggle,
+                                 const gboolean convert,
+                                 const gboolean user_interaction,
+                                 gpointer user_data)
+{
+    request_track (invocation);
+    PROBE_REQUEST_SCOPE (request_get_id (invocation));
+    settings_ensure_loaded (SETTINGS_FILE_KEYMAPS);
+    settings_ensure_loaded (SETTINGS_FILE_X11);
+
+    if (read_only)
+        request_return_dbus_error (invocation,
+                                   DBUS_ERROR_NOT_SUPPORTED,
+                                   SERVICE_NAME " is in read-only mode");
+    else if (!keymap_name_is_valid (keymap) || !keymap_name_is_valid (keymap_toggle))
+        reject_invalid_args (invocation, "Invalid keymap name");
+    else if (!keymap_is_known (keymap) || !keymap_is_known (keymap_toggle))
+        reject_invalid_args (invocation, "Keymap not installed");
+    else if (set_vconsole_keyboard_is_noop (keymap, keymap_toggle)) {
+        complete_noop ("SetVConsoleKeyboard");
+        blocaled_locale1_complete_set_vconsole_keyboard (locale1, invocation);
+    } else {
+        struct invoked_vconsole_keyboard *data;
+        data = g_new0 (struct invoked_vconsole_keyboard, 1);
+        data->invocation = invocation;
+        data->vconsole_keymap = g_strdup (keymap);
+        data->vconsole_keymap_toggle = g_strdup (keymap_toggle);
+        data->convert = convert;
+        request_validated (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_vconsole_keyboard_authorized_cb, data);
+        G_LOCK (keymaps);
+        if (convert)
+            G_LOCK (xorg_conf);
+        set_vconsole_keyboard_prepare (data);
+        if (convert)
+            G_UNLOCK (xorg_conf);
+        G_UNLOCK (keymaps);
+    }
+
+    return TRUE;
+}
+
+struct invoked_x11_keyboard {
+    GDBusMethodInvocation *invocation;
+    gchar *x11_layout; /* newly allocated */
+    gchar *x11_model; /* newly allocated */
+    gchar *x11_variant; /* newly allocated */
+    gchar *x11_options; /* newly allocated */
+    gboolean convert;
+
+    /* Prepared while authorizing */
+    struct file_stamp stamps[3];
+    GList *kbd_model_map;
+    struct kbd_model_map_entry *best_entry; /* NULL if no conversion */
+    struct xorg_confd_parser *x11_parser;
+    ShellParser *keymaps_parser; /* NULL if the keymap is unchanged */
+    GError *error;
+};
+
+static void
+invoked_x11_keyboard_reset (struct invoked_x11_keyboard *data)
+{
+    if (data->kbd_model_map != NULL)
+        g_list_free_full (data->kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
+    data->kbd_model_map = NULL;
+    data->best_entry = NULL;
+    file_stamps_clear (data->stamps, G_N_ELEMENTS (data->stamps));
+    g_clear_pointer (&data->x11_parser, xorg_confd_parser_free);
+    g_clear_pointer (&data->keymaps_parser, shell_parser_free);
+    g_clear_error (&data->error);
+}
+
+static void
+invoked_x11_keyboard_free (struct invoked_x11_keyboard *data)
+{
+    if (data == NULL)
+        return;
+    invoked_x11_keyboard_reset (data);
+    g_free (data->x11_layout);
+    g_free (data->x11_model);
+    g_free (data->x11_variant);
+    g_free (data->x11_options);
+    g_free (data);
+}
+
+/*
+ * set_x11_keyboard_prepare:
+ * @data: the request
+ *
+ * Compute the new content of the X11 keyboard file, and if converting, of
+ * the keymap file. On failure, @data->error is set. Must be called with
+ * the xorg_conf lock held, and also the keymaps lock if converting.
+ */
+
+static void
+set_x11_keyboard_prepare (struct invoked_x11_keyboard *data)
+{
+    unsigned int best_failure_score = UINT_MAX;
+    gint64 start;
+
+    file_stamp_take (&data->stamps[0], x11_file);
+    if (data->convert) {
+        GList *cur;
+
+        file_stamp_take (&data->stamps[1], kbd_model_map_file);
+        file_stamp_take (&data->stamps[2], keymaps_file);
+        PROBE2 (kbd_model_map_lookup__start, PROBE_REQUEST_ID, data->x11_layout);
+        start = g_get_monotonic_time ();
+        data->kbd_model_map = kbd_model_map_load (&data->error);
+        if (data->error != NULL)
+            return;
+
+        for (cur = data->kbd_model_map; cur->next != NULL; cur = cur->next) {
+            struct kbd_model_map_entry *cur_entry = NULL;
+            unsigned int cur_failure_score = 0;
+
+            cur_entry = (struct kbd_model_map_entry *) cur->data;
+            if (kbd_model_map_entry_matches_x11 (cur_entry, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options, &cur_failure_score))
+                if (cur_failure_score < best_failure_score) {
+                    data->best_entry = cur_entry;
+                    best_failure_score = cur_failure_score;
+                }
+        }
+        stats_stage_add (STATS_STAGE_MAP_LOOKUP, start);
+        PROBE2 (kbd_model_map_lookup__done, PROBE_REQUEST_ID, data->best_entry != NULL);
+    }
+
+    if ((data->x11_parser = xorg_confd_parser_new (x11_file, TRUE, &data->error)) == NULL)
+        return;
+    xorg_confd_parser_set_xkb (data->x11_parser, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options);
+
+    if (data->convert) {
+        if (data->best_entry == NULL) {
+            /* Not an error, and this may run before polkit has answered */
+            g_debug ("Failed to find conversion entry for x11 layout '%s' in '%s'", data->x11_layout, g_file_peek_path (kbd_model_map_file));
+        } else if ((data->keymaps_parser = shell_parser_new (keymaps_file, &data->error)) == NULL ||
+                   !shell_parser_set_variables (data->keymaps_parser, &data->error, "KEYMAP", "keymap", data->best_entry->vconsole_keymap, NULL))
+            return;
+    }
+}
+
+static void
+on_handle_set_x11_keyboard_authorized_cb (GObject *source_object,
+                                          GAsyncResult *res,
+                                          gpointer user_data)
+{
+    GError *err = NULL;
+    struct invoked_x11_keyboard *data;
+    FileTransaction *trans = NULL;
+
+    data = (struct invoked_x11_keyboard *) user_data;
+    PROBE_REQUEST_SCOPE (request_get_id (data->invocation));
+    if (!check_polkit_finish (res, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto out;
+    }
+
+    G_LOCK (xorg_conf);
+    if (data->convert)
+        G_LOCK (keymaps);
+    if (!file_stamps_are_current (data->stamps, G_N_ELEMENTS (data->stamps))) {
+        invoked_x11_keyboard_reset (data);
+        set_x11_keyboard_prepare (data);
+    }
+    if (data->error != NULL) {
+        request_return_gerror (data->invocation, data->error);
+        goto unlock;
+    }
+
+    /* Both files are replaced, or none */
+    trans = file_transaction_new ();
+    if (!xorg_confd_parser_stage (data->x11_parser, trans, &err) ||
+        (data->keymaps_parser != NULL && !shell_parser_stage (data->keymaps_parser, trans, &err)) ||
+        !file_transaction_commit (trans, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto unlock;
+    }
+
+    /* Only the properties which changed are set: with lazyload, the
+       others may never have been set in the skeleton */
+    if (setting_update (&x11_layout, g_strdup (data->x11_layout), "X11Layout"))
+        blocaled_locale1_set_x11_layout (locale1, x11_layout);
+    if (setting_update (&x11_model, g_strdup (data->x11_model), "X11Model"))
+        blocaled_locale1_set_x11_model (locale1, x11_model);
+    if (setting_update (&x11_variant, g_strdup (data->x11_variant), "X11Variant"))
+        blocaled_locale1_set_x11_variant (locale1, x11_variant);
+    if (setting_update (&x11_options, g_strdup (data->x11_options), "X11Options"))
+        blocaled_locale1_set_x11_options (locale1, x11_options);
+
+    if (data->keymaps_parser != NULL &&
+        setting_update (&vconsole_keymap, g_strdup (data->best_entry->vconsole_keymap), "VConsoleKeymap"))
+        blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
+
+  //finish: (not used right now, but keep in case we add other codepaths)
+    blocaled_locale1_complete_set_x11_keyboard (locale1, data->invocation);
+
+  unlock:
+    if (data->convert)
+        G_UNLOCK (keymaps);
+    G_UNLOCK (xorg_conf);
+
+  out:
+    file_transaction_free (trans);
+    invoked_x11_keyboard_free (data);
+    if (err != NULL)
+        g_error_free (err);
+}
+
+static gboolean
+set_x11_keyboard_is_noop (const gchar *layout,
+                          const gchar *model,
+                          const gchar *variant,
+                          const gchar *options)
+{
+    gboolean ret;
+
+    G_LOCK (xorg_conf);
+    ret = setting_equal (layout, x11_layout) &&
+          setting_equal (model, x11_model) &&
+          setting_equal (variant, x11_variant) &&
+          setting_equal (options, x11_options);
+    G_UNLOCK (xorg_conf);
+    return ret;
+}
+
+static gboolean
+on_handle_set_x11_keyboard (BLocaledLocale1 *locale1,
+                            GDBusMethodInvocation *invocation,
+                            const gchar *layout,
+                            const gchar *model,
+                            const gchar *variant,
+                            const gchar *options,
+                            const gboolean convert,
+                            const gboolean user_interaction,
+                            gpointer user_data)
+{
+    request_track (invocation);
+    PROBE_REQUEST_SCOPE (request_get_id (invocation));
+    settings_ensure_loaded (SETTINGS_FILE_KEYMAPS);
+    settings_ensure_loaded (SETTINGS_FILE_X11);
+
+    if (read_only)
+        request_return_dbus_error (invocation,
+                                   DBUS_ERROR_NOT_SUPPORTED,
+                                   SERVICE_NAME " is in read-only mode");
+    else if (!x11_value_is_valid (layout) || !x11_value_is_valid (model) ||
+             !x11_value_is_valid (variant) || !x11_value_is_valid (options))
+        reject_invalid_args (invocation, "Invalid X11 keyboard layout, model, variant or options");
+    else if (!x11_keyboard_is_known (layout, model, variant, options))
+        reject_invalid_args (invocation, "Unknown X11 keyboard layout, model, variant or option");
+    else if (set_x11_keyboard_is_noop (layout, model, variant, options)) {
+        complete_noop ("SetX11Keyboard");
+        blocaled_locale1_complete_set_x11_keyboard (locale1, invocation);
+    } else {
+        struct invoked_x11_keyboard *data;
+        data = g_new0 (struct invoked_x11_keyboard, 1);
+        data->invocation = invocation;
+        data->x11_layout = g_strdup (layout);
+        data->x11_model = g_strdup (model);
+        data->x11_variant = g_strdup (variant);
+        data->x11_options = g_strdup (options);
+        data->convert = convert;
+        request_validated (invocation);
+        check_polkit_async (invocation, "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_x11_keyboard_authorized_cb, data);
+        G_LOCK (xorg_conf);
+        if (convert)
+            G_LOCK (keymaps);
+        set_x11_keyboard_prepare (data);
+        if (convert)
+            G_UNLOCK (keymaps);
+        G_UNLOCK (xorg_conf);
+    }
+
+    return TRUE;
+}
+
+/*
+  Reading the settings files, at start, and again when they are modified
+  by something else than blocaled. The stamp of each file is taken before
+  reading it, for the snapshot.
+*/
+
+static struct file_stamp locale_stamp;
+static struct file_stamp keymaps_stamp;
+static struct file_stamp x11_stamp;
+
+static gchar **
+locale_read (void)
+{
+    GError *err = NULL;
+    gchar **locale_values, **ret;
+
+    file_stamp_take (&locale_stamp, locale_file);
+    ret = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
+    locale_values = shell_parser_source_var_list (locale_file, (const gchar * const *)locale_variables, &err);
+    if (locale_values != NULL) {
+        gchar **variable, **value, **loc;
+        loc = ret;
+        for (variable = locale_variables, value = locale_values; *variable != NULL; variable++, value++) {
+            if (*value != NULL) {
+                *loc = g_strdup_printf ("%s=%s", *variable, *value);
+                g_free (*value);
+                loc++;
+            }
+        }
+
+        g_free (locale_values);
+    }
+    if (err != NULL) {
+        g_debug ("%s", err->message);
+        g_clear_error (&err);
+    }
+    return ret;
+}
+
+/* Also sets keymap_var and toggle_var, after what is found in the file */
+static void
+keymaps_read (gchar **keymap_p,
+              gchar **keymap_toggle_p)
+{
+    GError *err = NULL;
+    gchar **keymap_values;
+    gchar *keymap = NULL, *keymap_toggle = NULL;
+
+    file_stamp_take (&keymaps_stamp, keymaps_file);
+    keymap_var = "KEYMAP";
+    toggle_var = "KEYMAP_TOGGLE";
+    keymap_values = shell_parser_source_var_list (
+                               keymaps_file,
+                               (const gchar * const *)keymap_variables,
+                               &err);
+    if (keymap_values != NULL) {
+        if (keymap_values[0] != NULL) {
+            if (keymap_values[1] != NULL) {
+                g_debug("Both KEYMAP and keymap are set in %s; keeping KEYMAP",
+                         g_file_peek_path (keymaps_file));
+                g_free (keymap_values[1]);
+            }
+            keymap = keymap_values[0];
+        } else if (keymap_values[1] != NULL) {
+            keymap = keymap_values[1];
+            keymap_var = "keymap";
+            toggle_var = NULL;
+        }
+        if (keymap_values[2] != NULL) {
+            if (keymap_values[3] != NULL) {
+                g_debug("Both KEYMAP_TOGGLE and KEYMAP_CORRECTIONS are set in %s; keeping KEYMAP_TOGGLE",
+                         g_file_peek_path (keymaps_file));
+                g_free (keymap_values[3]);
+            }
+            keymap_toggle = keymap_values[2];
+        } else if (keymap_values[3] != NULL) {
+            keymap_toggle = keymap_values[3];
+            toggle_var = "KEYMAP_CORRECTIONS";
+        }
+        g_free (keymap_values);
+    }
+    if (err != NULL) {
+        g_debug ("%s", err->message);
+        g_clear_error (&err);
+    }
+    *keymap_p = keymap != NULL ? keymap : g_strdup ("");
+    *keymap_toggle_p = keymap_toggle != NULL ? keymap_toggle : g_strdup ("");
+}
+
+static void
+x11_read (gchar **layout_p,
+          gchar **model_p,
+          gchar **variant_p,
+          gchar **options_p)
+{
+    GError *err = NULL;
+    struct xorg_confd_parser *x11_parser;
+
+    file_stamp_take (&x11_stamp, x11_file);
+    *layout_p = *model_p = *variant_p = *options_p = NULL;
+    x11_parser = xorg_confd_parser_new (x11_file, FALSE, &err);
+    if (x11_parser != NULL) {
+        xorg_confd_parser_get_xkb (x11_parser, layout_p, model_p, variant_p, options_p);
+        xorg_confd_parser_free (x11_parser);
+    } else {
+        g_debug ("%s", err->message);
+        g_clear_error (&err);
+    }
+}
+
+static void
+locale_reload (void)
+{
+    gchar **new_locale;
+
+    G_LOCK (locale);
+    new_locale = locale_read ();
+    if (g_strv_equal ((const gchar * const *) locale, (const gchar * const *) new_locale)) {
+        g_strfreev (new_locale);
+    } else {
+        g_debug ("Locale changed");
+        g_strfreev (locale);
+        locale = new_locale;
+        if (locale1 != NULL)
+            blocaled_locale1_set_locale (locale1, (const gchar * const *) locale);
+    }
+    G_UNLOCK (locale);
+}
+
+static void
+keymaps_reload (void)
+{
+    gchar *keymap, *keymap_toggle;
+
+    G_LOCK (keymaps);
+    keymaps_read (&keymap, &keymap_toggle);
+    if (setting_update (&vconsole_keymap, keymap, "VConsoleKeymap") && locale1 != NULL)
+        blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
+    if (setting_update (&vconsole_keymap_toggle, keymap_toggle, "VConsoleKeymapToggle") && locale1 != NULL)
+        blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
+    G_UNLOCK (keymaps);
+}
+
+static void
+x11_reload (void)
+{
+    gchar *layout, *model, *variant, *options;
+
+    G_LOCK (xorg_conf);
+    x11_read (&layout, &model, &variant, &options);
+    if (setting_update (&x11_layout, layout, "X11Layout") && locale1 != NULL)
+        blocaled_locale1_set_x11_layout (locale1, x11_layout);
+    if (setting_update (&x11_model, model, "X11Model") && locale1 != NULL)
+        blocaled_locale1_set_x11_model (locale1, x11_model);
+    if (setting_update (&x11_variant, variant, "X11Variant") && locale1 != NULL)
+        blocaled_locale1_set_x11_variant (locale1, x11_variant);
+    if (setting_update (&x11_options, options, "X11Options") && locale1 != NULL)
+        blocaled_locale1_set_x11_options (locale1, x11_options);
+    G_UNLOCK (xorg_conf);
+}
+
+/*
+  The settings files are watched once the interface is exported. A file
+  monitor actually watches the parent directory, so a file replaced by a
+  rename (as editors, and blocaled itself, do) is noticed. Editors may
+  generate several events for one save, so the file is only read again
+  once no event has come for SETTINGS_RELOAD_DELAY milliseconds. The
+  files written by blocaled are read again too, but since nothing
+  differs then, no property is changed.
+*/
+
+#define SETTINGS_RELOAD_DELAY 200
+
+struct settings_watch {
+    enum SETTINGS_FILE which;
+    GFile **file;
+    void (*reload) (void);
+    GFileMonitor *monitor;
+    guint timeout_id;
+};
+
+static struct settings_watch settings_watches[] = {
+    { SETTINGS_FILE_LOCALE, &locale_file, locale_reload, NULL, 0 },
+    { SETTINGS_FILE_KEYMAPS, &keymaps_file, keymaps_reload, NULL, 0 },
+    { SETTINGS_FILE_X11, &x11_file, x11_reload, NULL, 0 },
+};
+
+static gboolean
+on_settings_reload_timeout (gpointer user_data)
+{
+    struct settings_watch *watch = (struct settings_watch *) user_data;
+
+    watch->timeout_id = 0;
+    /* Not read yet: it will be, when needed */
+    if (!settings_loaded[watch->which])
+        return G_SOURCE_REMOVE;
+    g_debug ("Reading '%s' again", g_file_peek_path (*watch->file));
+    watch->reload ();
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_settings_file_changed (GFileMonitor *monitor,
+                          GFile *file,
+                          GFile *other_file,
+                          GFileMonitorEvent event_type,
+                          gpointer user_data)
+{
+    struct settings_watch *watch = (struct settings_watch *) user_data;
+
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+        return;
+    if (watch->timeout_id != 0)
+        g_source_remove (watch->timeout_id);
+    watch->timeout_id = g_timeout_add (SETTINGS_RELOAD_DELAY, on_settings_reload_timeout, watch);
+}
+
+static gboolean settings_watching = FALSE;
+
+static void
+settings_watch_start (void)
+{
+    guint i;
+
+    settings_watching = TRUE;
+    for (i = 0; i < G_N_ELEMENTS (settings_watches); i++) {
+        struct settings_watch *watch = &settings_watches[i];
+        GError *err = NULL;
+
+        watch->monitor = g_file_monitor_file (*watch->file, G_FILE_MONITOR_NONE, NULL, &err);
+        if (watch->monitor == NULL) {
+            g_debug ("Cannot watch '%s': %s", g_file_peek_path (*watch->file), err->message);
+            g_clear_error (&err);
+            continue;
+        }
+        g_signal_connect (watch->monitor, "changed", G_CALLBACK (on_settings_file_changed), watch);
+    }
+}
+
+static void
+settings_watch_stop (void)
+{
+    guint i;
+
+    settings_watching = FALSE;
+    for (i = 0; i < G_N_ELEMENTS (settings_watches); i++) {
+        struct settings_watch *watch = &settings_watches[i];
+
+        if (watch->timeout_id != 0) {
+            g_source_remove (watch->timeout_id);
+            watch->timeout_id = 0;
+        }
+        if (watch->monitor != NULL) {
+            g_signal_handlers_disconnect_by_data (watch->monitor, watch);
+            g_file_monitor_cancel (watch->monitor);
+            g_clear_object (&watch->monitor);
+        }
+    }
+}
+
+/*
+  When blocaled exits after being idle, the values read from the settings
+  files are saved in a snapshot, a serialized GVariant, with the stamp of
+  each file. On next start, the values of a file are taken from the
+  snapshot if its stamp still matches, instead of parsing the file.
+*/
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TYPE "(u(s(bttxxx)as)(s(bttxxx)sssms)(s(bttxxx)msmsmsms))"
+
+static GVariant *
+file_stamp_to_variant (const struct file_stamp *stamp)
+{
+    return g_variant_new ("(bttxxx)",
+                          stamp->exists,
+                          (guint64) stamp->dev,
+                          (guint64) stamp->ino,
+                          (gint64) stamp->size,
+                          (gint64) stamp->mtime.tv_sec,
+                          (gint64) stamp->mtime.tv_nsec);
+}
+
+static void
+snapshot_save (void)
+{
+    static const gchar *no_locale[] = { NULL };
+    const gchar *paths[SETTINGS_N_FILES];
+    GVariant *snapshot;
+    GError *err = NULL;
+    guint i;
+
+    if (snapshot_file == NULL)
+        return;
+
+    /* The entry of a file not read has no path, so it never matches */
+    paths[SETTINGS_FILE_LOCALE] = g_file_peek_path (locale_file);
+    paths[SETTINGS_FILE_KEYMAPS] = g_file_peek_path (keymaps_file);
+    paths[SETTINGS_FILE_X11] = g_file_peek_path (x11_file);
+    for (i = 0; i < SETTINGS_N_FILES; i++)
+        if (!settings_loaded[i])
+            paths[i] = "";
+
+    G_LOCK (locale);
+    G_LOCK (keymaps);
+    G_LOCK (xorg_conf);
+    snapshot = g_variant_new ("(u(s@(bttxxx)^as)(s@(bttxxx)sssms)(s@(bttxxx)msmsmsms))",
+                              SNAPSHOT_VERSION,
+                              paths[SETTINGS_FILE_LOCALE], file_stamp_to_variant (&locale_stamp),
+                              locale != NULL ? locale : (gchar **) no_locale,
+                              paths[SETTINGS_FILE_KEYMAPS], file_stamp_to_variant (&keymaps_stamp),
+                              vconsole_keymap != NULL ? vconsole_keymap : "",
+                              vconsole_keymap_toggle != NULL ? vconsole_keymap_toggle : "",
+                              keymap_var, toggle_var,
+                              paths[SETTINGS_FILE_X11], file_stamp_to_variant (&x11_stamp),
+                              x11_layout, x11_model, x11_variant, x11_options);
+    G_UNLOCK (xorg_conf);
+    G_UNLOCK (keymaps);
+    G_UNLOCK (locale);
+
+    g_variant_ref_sink (snapshot);
+    if (!g_file_set_contents (snapshot_file, g_variant_get_data (snapshot), g_variant_get_size (snapshot), &err)) {
+        g_warning ("Failed to save the snapshot: %s", err->message);
+        g_clear_error (&err);
+    } else
+        g_debug ("Snapshot saved in '%s'", snapshot_file);
+    g_variant_unref (snapshot);
+}
+
+static GVariant *
+snapshot_load (void)
+{
+    gchar *contents = NULL;
+    gsize length;
+    GVariant *snapshot;
+    guint32 version;
+
+    if (snapshot_file == NULL || !g_file_get_contents (snapshot_file, &contents, &length, NULL))
+        return NULL;
+
+    /* Not trusted: GVariant checks the serialized data as it is read */
+    snapshot = g_variant_new_from_data (G_VARIANT_TYPE (SNAPSHOT_TYPE), contents, length, FALSE, g_free, contents);
+    g_variant_ref_sink (snapshot);
+    g_variant_get_child (snapshot, 0, "u", &version);
+    if (version != SNAPSHOT_VERSION) {
+        g_variant_unref (snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+/*
+ * snapshot_get_entry:
+ * @snapshot: (nullable): the snapshot
+ * @index: the position of the entry of @file in @snapshot
+ * @file: a settings file
+ * @stamp: (out): the stamp of @file, if the entry is returned
+ *
+ * Returns: the entry of @file in @snapshot, or %NULL if there is no
+ * snapshot, or @file has changed since the snapshot was taken
+ */
+
+static GVariant *
+snapshot_get_entry (GVariant *snapshot,
+                    gsize index,
+                    GFile *file,
+                    struct file_stamp *stamp)
+{
+    GVariant *entry;
+    struct file_stamp saved = { 0 };
+    const gchar *path;
+    guint64 dev, ino;
+    gint64 size, sec, nsec;
+
+    if (snapshot == NULL)
+        return NULL;
+
+    entry = g_variant_get_child_value (snapshot, index);
+    g_variant_get_child (entry, 0, "&s", &path);
+    g_variant_get_child (entry, 1, "(bttxxx)", &saved.exists, &dev, &ino, &size, &sec, &nsec);
+    saved.dev = dev;
+    saved.ino = ino;
+    saved.size = size;
+    saved.mtime.tv_sec = sec;
+    saved.mtime.tv_nsec = nsec;
+    file_stamp_take (stamp, file);
+    if (g_strcmp0 (path, g_file_peek_path (file)) || !file_stamp_equal (stamp, &saved)) {
+        g_variant_unref (entry);
+        return NULL;
+    }
+    g_debug ("Using the snapshot for '%s'", path);
+    return entry;
+}
+
+static gboolean
+locale_restore (GVariant *snapshot)
+{
+    GVariant *entry;
+
+    if ((entry = snapshot_get_entry (snapshot, 1, locale_file, &locale_stamp)) == NULL)
+        return FALSE;
+    g_variant_get_child (entry, 2, "^as", &locale);
+    g_variant_unref (entry);
+    return TRUE;
+}
+
+/* The variable names have to point to keymap_variables */
+static gchar *
+keymap_variable_lookup (const gchar *name)
+{
+    gchar **var;
+
+    for (var = keymap_variables; name != NULL && *var != NULL; var++)
+        if (!strcmp (*var, name))
+            return *var;
+    return NULL;
+}
+
+static gboolean
+keymaps_restore (GVariant *snapshot)
+{
+    GVariant *entry;
+    const gchar *kvar, *tvar;
+
+    if ((entry = snapshot_get_entry (snapshot, 2, keymaps_file, &keymaps_stamp)) == NULL)
+        return FALSE;
+    g_variant_get (entry, "(&s(bttxxx)ss&sm&s)", NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                   &vconsole_keymap, &vconsole_keymap_toggle, &kvar, &tvar);
+    keymap_var = keymap_variable_lookup (kvar);
+    toggle_var = keymap_variable_lookup (tvar);
+    g_variant_unref (entry);
+    if (keymap_var == NULL) {
+        /* Not written by this version of blocaled */
+        g_clear_pointer (&vconsole_keymap, g_free);
+        g_clear_pointer (&vconsole_keymap_toggle, g_free);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+x11_restore (GVariant *snapshot)
+{
+    GVariant *entry;
+
+    if ((entry = snapshot_get_entry (snapshot, 3, x11_file, &x11_stamp)) == NULL)
+        return FALSE;
+    g_variant_get (entry, "(&s(bttxxx)msmsmsms)", NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                   &x11_layout, &x11_model, &x11_variant, &x11_options);
+    g_variant_unref (entry);
+    return TRUE;
+}
+
+/*
+  At start, the settings files which cannot be restored from the snapshot
+  are parsed by one thread each (unless in lazy mode), while the
+  connection to the bus is set up. The threads are joined in on_bus_acquired, before the interfaces
+  are exported. The name is only requested once they are, so D-Bus keeps
+  the calls coming meanwhile in its queue, and no call sees a property
+  which is not set yet.
+*/
+
+struct startup_reader {
+    const gchar *name;
+    gboolean (*restore) (GVariant *snapshot);
+    void (*read) (void);
+    GThread *thread;
+    gboolean restored;
+    gint64 usec;      /* time spent restoring or reading */
+};
+
+static void
+locale_read_initial (void)
+{
+    locale = locale_read ();
+}
+
+static void
+keymaps_read_initial (void)
+{
+    keymaps_read (&vconsole_keymap, &vconsole_keymap_toggle);
+}
+
+static void
+x11_read_initial (void)
+{
+    x11_read (&x11_layout, &x11_model, &x11_variant, &x11_options);
+}
+
+/* Keep in the same order as enum SETTINGS_FILE */
+static struct startup_reader startup_readers[] = {
+    { "locale", locale_restore, locale_read_initial, NULL, FALSE, 0 },
+    { "keymaps", keymaps_restore, keymaps_read_initial, NULL, FALSE, 0 },
+    { "xorg", x11_restore, x11_read_initial, NULL, FALSE, 0 },
+};
+
+/* Monotonic times of the startup phases, for the timing log */
+static gint64 startup_begin = 0;
+static gint64 startup_bus_acquired = 0;
+static gint64 startup_settings_ready = 0;
+static gint64 startup_exported = 0;
+
+static gpointer
+startup_reader_thread (gpointer user_data)
+{
+    struct startup_reader *reader = (struct startup_reader *) user_data;
+    gint64 begin = g_get_monotonic_time ();
+
+    reader->read ();
+    reader->usec = g_get_monotonic_time () - begin;
+    return NULL;
+}
+
+static void
+startup_readers_start (void)
+{
+    GVariant *snapshot;
+    guint i;
+
+    snapshot = snapshot_load ();
+    for (i = 0; i < G_N_ELEMENTS (startup_readers); i++) {
+        struct startup_reader *reader = &startup_readers[i];
+        gint64 begin = g_get_monotonic_time ();
+
+        if ((reader->restored = reader->restore (snapshot))) {
+            reader->usec = g_get_monotonic_time () - begin;
+            settings_loaded[i] = TRUE;
+        } else if (!lazy_load) {
+            reader->thread = g_thread_new (reader->name, startup_reader_thread, reader);
+            settings_loaded[i] = TRUE;
+        }
+    }
+    if (snapshot != NULL)
+        g_variant_unref (snapshot);
+}
+
+static void
+startup_readers_join (void)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (startup_readers); i++) {
+        if (startup_readers[i].thread != NULL) {
+            g_thread_join (startup_readers[i].thread);
+            startup_readers[i].thread = NULL;
+        }
+    }
+}
+
+static void
+startup_log_timing (void)
+{
+    GString *readers = g_string_new (NULL);
+    gint64 now = g_get_monotonic_time ();
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (startup_readers); i++) {
+        if (i != 0)
+            g_string_append (readers, ", ");
+        if (!settings_loaded[i])
+            g_string_append_printf (readers, "%s not read", startup_readers[i].name);
+        else
+            g_string_append_printf (readers, "%s %.1f ms%s",
+                                    startup_readers[i].name,
+                                    startup_readers[i].usec / 1000.0,
+                                    startup_readers[i].restored ? " (snapshot)" : "");
+    }
+    g_debug ("Startup timing: settings [%s], bus connection %.1f ms, "
+             "waiting for the settings %.1f ms, export %.1f ms, "
+             "name %.1f ms, total %.1f ms",
+             readers->str,
+             (startup_bus_acquired - startup_begin) / 1000.0,
+             (startup_settings_ready - startup_bus_acquired) / 1000.0,
+             (startup_exported - startup_settings_ready) / 1000.0,
+             (now - startup_exported) / 1000.0,
+             (now - startup_begin) / 1000.0);
+    g_string_free (readers, TRUE);
+}
+
+/*
+  The values of each file are published as properties once known. In
+  lazy mode, the object exported is a LazyLocale1Skeleton: its vtable
+  reads the file backing a property when that property is first asked
+  for, through Get or GetAll, and answers from the values read. Setting
+  them in the skeleton then would broadcast a PropertiesChanged for
+  values which did not change, so the skeleton of a lazy instance only
+  gets the values which change afterwards. The method handlers load the
+  files they need themselves.
+*/
+
+static void
+settings_publish (enum SETTINGS_FILE which)
+{
+    switch (which) {
+    case SETTINGS_FILE_LOCALE:
+        blocaled_locale1_set_locale (locale1, (const gchar * const *) locale);
+        break;
+    case SETTINGS_FILE_KEYMAPS:
+        blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
+        blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
+        break;
+    case SETTINGS_FILE_X11:
+        blocaled_locale1_set_x11_layout (locale1, x11_layout);
+        blocaled_locale1_set_x11_model (locale1, x11_model);
+        blocaled_locale1_set_x11_variant (locale1, x11_variant);
+        blocaled_locale1_set_x11_options (locale1, x11_options);
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+}
+
+static void
+settings_ensure_loaded (enum SETTINGS_FILE which)
+{
+    gint64 begin;
+
+    if (settings_loaded[which])
+        return;
+
+    begin = g_get_monotonic_time ();
+    startup_readers[which].read ();
+    settings_loaded[which] = TRUE;
+    g_debug ("Read the %s settings on first use in %.1f ms", startup_readers[which].name,
+             (g_get_monotonic_time () - begin) / 1000.0);
+}
+
+typedef struct {
+    BLocaledLocale1Skeleton parent_instance;
+} LazyLocale1Skeleton;
+
+typedef struct {
+    BLocaledLocale1SkeletonClass parent_class;
+} LazyLocale1SkeletonClass;
+
+G_DEFINE_TYPE (LazyLocale1Skeleton, lazy_locale1_skeleton, BLOCALED_TYPE_LOCALE1_SKELETON);
+
+static GDBusInterfaceVTable lazy_locale1_vtable;
+static GDBusInterfaceGetPropertyFunc parent_get_property = NULL;
+
+static GVariant *
+setting_to_variant (const gchar *value)
+{
+    return g_variant_new_string (value != NULL ? value : "");
+}
+
+static GVariant *
+lazy_locale1_get_property (GDBusConnection *connection,
+                           const gchar *sender,
+                           const gchar *object_path,
+                           const gchar *interface_name,
+                           const gchar *property_name,
+                           GError **error,
+                           gpointer user_data)
+{
+    GVariant *ret = NULL;
+
+    if (!strcmp (property_name, "Locale")) {
+        settings_ensure_loaded (SETTINGS_FILE_LOCALE);
+        G_LOCK (locale);
+        ret = g_variant_new_strv ((const gchar * const *) locale, locale != NULL ? -1 : 0);
+        G_UNLOCK (locale);
+    } else if (g_str_has_prefix (property_name, "VConsole")) {
+        settings_ensure_loaded (SETTINGS_FILE_KEYMAPS);
+        G_LOCK (keymaps);
+        if (!strcmp (property_name, "VConsoleKeymap"))
+            ret = setting_to_variant (vconsole_keymap);
+        else if (!strcmp (property_name, "VConsoleKeymapToggle"))
+            ret = setting_to_variant (vconsole_keymap_toggle);
+        G_UNLOCK (keymaps);
+    } else if (g_str_has_prefix (property_name, "X11")) {
+        settings_ensure_loaded (SETTINGS_FILE_X11);
+        G_LOCK (xorg_conf);
+        if (!strcmp (property_name, "X11Layout"))
+            ret = setting_to_variant (x11_layout);
+        else if (!strcmp (property_name, "X11Model"))
+            ret = setting_to_variant (x11_model);
+        else if (!strcmp (property_name, "X11Variant"))
+            ret = setting_to_variant (x11_variant);
+        else if (!strcmp (property_name, "X11Options"))
+            ret = setting_to_variant (x11_options);
+        G_UNLOCK (xorg_conf);
+    }
+    if (ret != NULL)
+        return ret;
+    return parent_get_property (connection, sender, object_path, interface_name,
+                                property_name, error, user_data);
+}
+
+static GDBusInterfaceVTable *
+lazy_locale1_skeleton_get_vtable (GDBusInterfaceSkeleton *skeleton)
+{
+    GDBusInterfaceVTable *vtable;
+
+    vtable = G_DBUS_INTERFACE_SKELETON_CLASS (lazy_locale1_skeleton_parent_class)->get_vtable (skeleton);
+    if (parent_get_property == NULL) {
+        lazy_locale1_vtable = *vtable;
+        parent_get_property = vtable->get_property;
+        lazy_locale1_vtable.get_property = lazy_locale1_get_property;
+    }
+    return &lazy_locale1_vtable;
+}
+
+static void
+lazy_locale1_skeleton_class_init (LazyLocale1SkeletonClass *klass)
+{
+    GDBusInterfaceSkeletonClass *skeleton_class = G_DBUS_INTERFACE_SKELETON_CLASS (klass);
+
+    skeleton_class->get_vtable = lazy_locale1_skeleton_get_vtable;
+}
+
+static void
+lazy_locale1_skeleton_init (LazyLocale1Skeleton *skeleton)
+{
+}
+
+static gboolean
+on_handle_list_locales (BLocaledLocale1Extensions *extensions,
+                        GDBusMethodInvocation *invocation,
+                        gpointer user_data)
+{
+    gchar **locales = locale_index_list ();
+
+    request_track (invocation);
+
+    blocaled_locale1_extensions_complete_list_locales (extensions, invocation, (const gchar * const *) locales);
+    g_strfreev (locales);
+    return TRUE;
+}
+
+static gboolean
+on_handle_list_vconsole_keymaps (BLocaledLocale1Extensions *extensions,
+                                 GDBusMethodInvocation *invocation,
+                                 gpointer user_data)
+{
+    gchar **keymaps = keymap_index_list ();
+
+    request_track (invocation);
+
+    blocaled_locale1_extensions_complete_list_vconsole_keymaps (extensions, invocation, (const gchar * const *) keymaps);
+    g_strfreev (keymaps);
+    return TRUE;
+}
+
+static gboolean
+on_handle_list_x11_layouts (BLocaledLocale1Extensions *extensions,
+                            GDBusMethodInvocation *invocation,
+                            gpointer user_data)
+{
+    const gchar * const *variants = xkb_index_list (XKB_INDEX_VARIANT);
+    const gchar * const *variant;
+    GVariantBuilder builder;
+
+    request_track (invocation);
+
+    /* The index holds "layout(variant)" */
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
+    for (variant = variants; *variant != NULL; variant++) {
+        const gchar *name = strchr (*variant, '(') + 1;
+
+        g_variant_builder_add_value (&builder,
+                                     g_variant_new ("(@s@s)",
+                                                    g_variant_new_take_string (g_strndup (*variant, name - 1 - *variant)),
+                                                    g_variant_new_take_string (g_strndup (name, strlen (name) - 1))));
+    }
+
+    blocaled_locale1_extensions_complete_list_x11_layouts (extensions, invocation,
+                                                           xkb_index_list (XKB_INDEX_LAYOUT),
+                                                           xkb_index_list (XKB_INDEX_MODEL),
+                                                           g_variant_builder_end (&builder),
+                                                           xkb_index_list (XKB_INDEX_OPTION));
+    return TRUE;
+}
+
+/*
+  SetAll: the three setters at once, without conversion. The parts which
+  would change nothing are dropped. The others are validated and
+  prepared like with the single setters, then committed in a single
+  transaction, under the three locks, taken in the order locale,
+  keymaps, xorg_conf.
+*/
+
+struct invoked_all {
+    GDBusMethodInvocation *invocation;
+    struct invoked_locale *locale;              /* NULL if unchanged */
+    struct invoked_vconsole_keyboard *vconsole; /* NULL if unchanged */
+    struct invoked_x11_keyboard *x11;           /* NULL if unchanged */
+};
+
+static void
+invoked_all_free (struct invoked_all *data)
+{
+    if (data == NULL)
+        return;
+    invoked_locale_free (data->locale);
+    invoked_vconsole_keyboard_free (data->vconsole);
+    invoked_x11_keyboard_free (data->x11);
+    g_free (data);
+}
+
+static void
+settings_lock_all (void)
+{
+    G_LOCK (locale);
+    G_LOCK (keymaps);
+    G_LOCK (xorg_conf);
+}
+
+static void
+settings_unlock_all (void)
+{
+    G_UNLOCK (xorg_conf);
+    G_UNLOCK (keymaps);
+    G_UNLOCK (locale);
+}
+
+/*
+ * set_all_prepare:
+ * @data: the request
+ * @again: if set, only the parts whose files changed are prepared again
+ *
+ * Compute the new content of the files. Must be called with all the
+ * locks held.
+ *
+ * Returns: the error of the first part which failed, or %NULL
+ */
+
+static const GError *
+set_all_prepare (struct invoked_all *data,
+                 gboolean again)
+{
+    if (data->locale != NULL) {
+        if (!again || !file_stamps_are_current (data->locale->stamps, G_N_ELEMENTS (data->locale->stamps))) {
+            invoked_locale_reset (data->locale);
+            set_locale_prepare (data->locale);
+        }
+        if (data->locale->error != NULL)
+            return data->locale->error;
+    }
+    if (data->vconsole != NULL) {
+        if (!again || !file_stamps_are_current (data->vconsole->stamps, G_N_ELEMENTS (data->vconsole->stamps))) {
+            invoked_vconsole_keyboard_reset (data->vconsole);
+            set_vconsole_keyboard_prepare (data->vconsole);
+        }
+        if (data->vconsole->error != NULL)
+            return data->vconsole->error;
+    }
+    if (data->x11 != NULL) {
+        if (!again || !file_stamps_are_current (data->x11->stamps, G_N_ELEMENTS (data->x11->stamps))) {
+            invoked_x11_keyboard_reset (data->x11);
+            set_x11_keyboard_prepare (data->x11);
+        }
+        if (data->x11->error != NULL)
+            return data->x11->error;
+    }
+    return NULL;
+}
+
+static void
+on_handle_set_all_authorized_cb (GObject *source_object,
+                                 GAsyncResult *res,
+                                 gpointer user_data)
+{
+    GError *err = NULL;
+    const GError *prepare_error;
+    struct invoked_all *data;
+    FileTransaction *trans = NULL;
+
+    data = (struct invoked_all *) user_data;
+    PROBE_REQUEST_SCOPE (request_get_id (data->invocation));
+    if (!check_polkit_finish (res, &err)) {
+        request_return_gerror (data->invocation, err);
+        goto out;
+    }
 
-    if (x11_parser == NULL) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
+    settings_lock_all ();
+    if ((prepare_error = set_all_prepare (data, TRUE)) != NULL) {
+        request_return_gerror (data->invocation, prepare_error);
         goto unlock;
     }
-    xorg_confd_parser_set_xkb (x11_parser, data->x11_layout, data->x11_model, data->x11_variant, data->x11_options);
-    if (!xorg_confd_parser_save (x11_parser, &err)) {
-        g_dbus_method_invocation_return_gerror (data->invocation, err);
+
+    /* All the files are replaced, or none */
+    trans = file_transaction_new ();
+    if ((data->locale != NULL && !shell_parser_stage (data->locale->parser, trans, &err)) ||
+        (data->vconsole != NULL && !shell_parser_stage (data->vconsole->keymaps_parser, trans, &err)) ||
+        (data->x11 != NULL && !xorg_confd_parser_stage (data->x11->x11_parser, trans, &err)) ||
+        !file_transaction_commit (trans, &err)) {
+        request_return_gerror (data->invocation, err);
         goto unlock;
     }
-    g_free (x11_layout);
-    g_free (x11_model);
-    g_free (x11_variant);
-    g_free (x11_options);
-    x11_layout = g_strdup (data->x11_layout);
-    x11_model = g_strdup (data->x11_model);
-    x11_variant = g_strdup (data->x11_variant);
-    x11_options = g_strdup (data->x11_options);
-    blocaled_locale1_set_x11_layout (locale1, x11_layout);
-    blocaled_locale1_set_x11_model (locale1, x11_model);
-    blocaled_locale1_set_x11_variant (locale1, x11_variant);
-    blocaled_locale1_set_x11_options (locale1, x11_options);
 
-    if (data->convert) {
-        if (best_entry == NULL) {
-            gchar *filename;
-            filename = g_file_get_path (kbd_model_map_file);
-            g_printerr ("Failed to find conversion entry for x11 layout '%s' in '%s'\n", data->x11_layout, filename);
-            g_free (filename);
-        } else {
-            if (!shell_parser_set_and_save (keymaps_file, &err, "KEYMAP", "keymap", best_entry->vconsole_keymap, NULL)) {
-                g_dbus_method_invocation_return_gerror (data->invocation, err);
-                goto unlock;
-            }
-            g_free (vconsole_keymap);
-            vconsole_keymap = g_strdup (best_entry->vconsole_keymap);
+    if (data->locale != NULL)
+        locale_set_values (data->locale->values);
+    if (data->vconsole != NULL) {
+        if (setting_update (&vconsole_keymap, g_strdup (data->vconsole->vconsole_keymap), "VConsoleKeymap"))
             blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
-        }
+        if (setting_update (&vconsole_keymap_toggle, g_strdup (data->vconsole->vconsole_keymap_toggle), "VConsoleKeymapToggle"))
+            blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
     }
+    if (data->x11 != NULL) {
+        if (setting_update (&x11_layout, g_strdup (data->x11->x11_layout), "X11Layout"))
+            blocaled_locale1_set_x11_layout (locale1, x11_layout);
+        if (setting_update (&x11_model, g_strdup (data->x11->x11_model), "X11Model"))
+            blocaled_locale1_set_x11_model (locale1, x11_model);
+        if (setting_update (&x11_variant, g_strdup (data->x11->x11_variant), "X11Variant"))
+            blocaled_locale1_set_x11_variant (locale1, x11_variant);
+        if (setting_update (&x11_options, g_strdup (data->x11->x11_options), "X11Options"))
+            blocaled_locale1_set_x11_options (locale1, x11_options);
+    }
+    /* The skeleton queues the changed properties: send them now, in a
+       single PropertiesChanged signal, before the reply */
+    g_dbus_interface_skeleton_flush (G_DBUS_INTERFACE_SKELETON (locale1));
 
-  //finish: (not used right now, but keep in case we add other codepaths)
-    blocaled_locale1_complete_set_x11_keyboard (locale1, data->invocation);
+    blocaled_locale1_extensions_complete_set_all (extensions, data->invocation);
 
   unlock:
-    if (data->convert)
-        G_UNLOCK (keymaps);
-    G_UNLOCK (xorg_conf);
+    settings_unlock_all ();
 
   out:
-    if (kbd_model_map != NULL)
-        g_list_free_full (kbd_model_map, (GDestroyNotify)kbd_model_map_entry_free);
-    xorg_confd_parser_free (x11_parser);
-    invoked_x11_keyboard_free (data);
+    file_transaction_free (trans);
+    invoked_all_free (data);
     if (err != NULL)
         g_error_free (err);
 }
 
 static gboolean
-on_handle_set_x11_keyboard (BLocaledLocale1 *locale1,
-                            GDBusMethodInvocation *invocation,
-                            const gchar *layout,
-                            const gchar *model,
-                            const gchar *variant,
-                            const gchar *options,
-                            const gboolean convert,
-                            const gboolean user_interaction,
-                            gpointer user_data)
+on_handle_set_all (BLocaledLocale1Extensions *extensions,
+                   GDBusMethodInvocation *invocation,
+                   const gchar * const *_locale,
+                   const gchar *keymap,
+                   const gchar *keymap_toggle,
+                   const gchar *layout,
+                   const gchar *model,
+                   const gchar *variant,
+                   const gchar *options,
+                   const gboolean user_interaction,
+                   gpointer user_data)
 {
-    if (read_only)
-        g_dbus_method_invocation_return_dbus_error (invocation,
-                                                    DBUS_ERROR_NOT_SUPPORTED,
-                                                    SERVICE_NAME " is in read-only mode");
-    else {
-        struct invoked_x11_keyboard *data;
-        data = g_new0 (struct invoked_x11_keyboard, 1);
-        data->invocation = invocation;
-        data->x11_layout = g_strdup (layout);
-        data->x11_model = g_strdup (model);
-        data->x11_variant = g_strdup (variant);
-        data->x11_options = g_strdup (options);
-        data->convert = convert;
-        check_polkit_async (g_dbus_method_invocation_get_sender (invocation), "org.freedesktop.locale1.set-keyboard", user_interaction, on_handle_set_x11_keyboard_authorized_cb, data);
+    struct invoked_all *data;
+    const gchar *message;
+
+    request_track (invocation);
+    PROBE_REQUEST_SCOPE (request_get_id (invocation));
+    settings_ensure_loaded (SETTINGS_FILE_LOCALE);
+    settings_ensure_loaded (SETTINGS_FILE_KEYMAPS);
+    settings_ensure_loaded (SETTINGS_FILE_X11);
+
+    if (read_only) {
+        request_return_dbus_error (invocation,
+                                   DBUS_ERROR_NOT_SUPPORTED,
+                                   SERVICE_NAME " is in read-only mode");
+        return TRUE;
+    }
+
+    data = g_new0 (struct invoked_all, 1);
+    data->invocation = invocation;
+    data->locale = g_new0 (struct invoked_locale, 1);
+    data->locale->invocation = invocation;
+    data->locale->locale = g_strdupv ((gchar **) _locale);
+
+    if (!keymap_name_is_valid (keymap) || !keymap_name_is_valid (keymap_toggle))
+        message = "Invalid keymap name";
+    else if (!keymap_is_known (keymap) || !keymap_is_known (keymap_toggle))
+        message = "Keymap not installed";
+    else if (!x11_value_is_valid (layout) || !x11_value_is_valid (model) ||
+             !x11_value_is_valid (variant) || !x11_value_is_valid (options))
+        message = "Invalid X11 keyboard layout, model, variant or options";
+    else if (!x11_keyboard_is_known (layout, model, variant, options))
+        message = "Unknown X11 keyboard layout, model, variant or option";
+    else
+        message = set_locale_validate (data->locale);
+    if (message != NULL) {
+        reject_invalid_args (invocation, message);
+        invoked_all_free (data);
+        return TRUE;
+    }
+
+    G_LOCK (locale);
+    if (set_locale_is_noop (data->locale))
+        g_clear_pointer (&data->locale, invoked_locale_free);
+    G_UNLOCK (locale);
+    if (!set_vconsole_keyboard_is_noop (keymap, keymap_toggle)) {
+        data->vconsole = g_new0 (struct invoked_vconsole_keyboard, 1);
+        data->vconsole->invocation = invocation;
+        data->vconsole->vconsole_keymap = g_strdup (keymap);
+        data->vconsole->vconsole_keymap_toggle = g_strdup (keymap_toggle);
+    }
+    if (!set_x11_keyboard_is_noop (layout, model, variant, options)) {
+        data->x11 = g_new0 (struct invoked_x11_keyboard, 1);
+        data->x11->invocation = invocation;
+        data->x11->x11_layout = g_strdup (layout);
+        data->x11->x11_model = g_strdup (model);
+        data->x11->x11_variant = g_strdup (variant);
+        data->x11->x11_options = g_strdup (options);
+    }
+
+    if (data->locale == NULL && data->vconsole == NULL && data->x11 == NULL) {
+        complete_noop ("SetAll");
+        blocaled_locale1_extensions_complete_set_all (extensions, invocation);
+        invoked_all_free (data);
+        return TRUE;
+    }
+
+    request_validated (invocation);
+    check_polkit_async (invocation, "org.freedesktop.locale1.set-all", user_interaction, on_handle_set_all_authorized_cb, data);
+    settings_lock_all ();
+    set_all_prepare (data, FALSE);
+    settings_unlock_all ();
+
+    return TRUE;
+}
+
+/*
+  The state file (see blocaled-shm.h) follows the properties. It is
+  written once the main loop is idle, so that the properties changed by
+  one request make a single generation. The values are taken from the
+  skeleton, since the setters may be called with a lock held.
+*/
+
+static void
+state_append (GString *text,
+              const gchar *name,
+              const gchar *value)
+{
+    gsize start = text->len;
+
+    if (name != NULL)
+        g_string_append_printf (text, "%s=", name);
+    g_string_append (text, value != NULL ? value : "");
+    /* One setting per line */
+    g_strdelimit (text->str + start, "\n", ' ');
+    g_string_append_c (text, '\n');
+}
+
+static gboolean
+on_state_publish (gpointer user_data)
+{
+    GString *text = g_string_new (NULL);
+    const gchar * const *loc;
+
+    state_publish_id = 0;
+    for (loc = blocaled_locale1_get_locale (locale1); loc != NULL && *loc != NULL; loc++)
+        state_append (text, NULL, *loc);
+    state_append (text, "KEYMAP", blocaled_locale1_get_vconsole_keymap (locale1));
+    state_append (text, "KEYMAP_TOGGLE", blocaled_locale1_get_vconsole_keymap_toggle (locale1));
+    state_append (text, "X11_LAYOUT", blocaled_locale1_get_x11_layout (locale1));
+    state_append (text, "X11_MODEL", blocaled_locale1_get_x11_model (locale1));
+    state_append (text, "X11_VARIANT", blocaled_locale1_get_x11_variant (locale1));
+    state_append (text, "X11_OPTIONS", blocaled_locale1_get_x11_options (locale1));
+    state_shm_publish (text->str);
+    g_string_free (text, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_locale1_notify (GObject *object,
+                   GParamSpec *pspec,
+                   gpointer user_data)
+{
+    if (state_publish_id == 0)
+        state_publish_id = g_idle_add (on_state_publish, NULL);
+}
+
+static void
+state_start (void)
+{
+    GError *err = NULL;
+    enum SETTINGS_FILE which;
+
+    /* Not fatal: the clients can still use the bus */
+    if (!state_shm_open (state_file, &err)) {
+        g_warning ("Failed to open the state file: %s", err->message);
+        g_clear_error (&err);
+        return;
     }
+    /* All the settings are published, so all must be read */
+    for (which = 0; which < SETTINGS_N_FILES; which++)
+        settings_ensure_loaded (which);
+    g_signal_connect (locale1, "notify", G_CALLBACK (on_locale1_notify), NULL);
+    on_state_publish (NULL);
+}
+
+/* The statistics are read without authorization, like the properties */
+
+static gboolean
+on_handle_get_counters (BLocaledLocale1Stats *stats,
+                        GDBusMethodInvocation *invocation,
+                        gpointer user_data)
+{
+    request_track (invocation);
+    blocaled_locale1_stats_complete_get_counters (stats, invocation, stats_counters_to_variant ());
+    return TRUE;
+}
 
+static gboolean
+on_handle_get_histograms (BLocaledLocale1Stats *stats,
+                          GDBusMethodInvocation *invocation,
+                          gpointer user_data)
+{
+    request_track (invocation);
+    blocaled_locale1_stats_complete_get_histograms (stats, invocation, stats_histograms_to_variant ());
     return TRUE;
 }
 
@@ -1287,18 +3313,25 @@ on_bus_acquired (GDBusConnection *connection,
                  gpointer         user_data)
 {
     GError *err = NULL;
+    enum SETTINGS_FILE which;
 
     g_debug ("Acquired a message bus connection");
+    startup_bus_acquired = g_get_monotonic_time ();
 
-    locale1 = blocaled_locale1_skeleton_new ();
+    startup_readers_join ();
+    startup_settings_ready = g_get_monotonic_time ();
 
-    blocaled_locale1_set_locale (locale1, (const gchar * const *) locale);
-    blocaled_locale1_set_vconsole_keymap (locale1, vconsole_keymap);
-    blocaled_locale1_set_vconsole_keymap_toggle (locale1, vconsole_keymap_toggle);
-    blocaled_locale1_set_x11_layout (locale1, x11_layout);
-    blocaled_locale1_set_x11_model (locale1, x11_model);
-    blocaled_locale1_set_x11_variant (locale1, x11_variant);
-    blocaled_locale1_set_x11_options (locale1, x11_options);
+    if (lazy_load)
+        locale1 = BLOCALED_LOCALE1 (g_object_new (lazy_locale1_skeleton_get_type (), NULL));
+    else
+        locale1 = blocaled_locale1_skeleton_new ();
+
+    for (which = 0; which < SETTINGS_N_FILES; which++)
+        if (settings_loaded[which])
+            settings_publish (which);
+
+    if (state_file != NULL)
+        state_start ();
 
     g_signal_connect (locale1, "handle-set-locale", G_CALLBACK (on_handle_set_locale), NULL);
     g_signal_connect (locale1, "handle-set-vconsole-keyboard", G_CALLBACK (on_handle_set_vconsole_keyboard), NULL);
@@ -1313,6 +3346,57 @@ on_bus_acquired (GDBusConnection *connection,
             localed_exit (1);
         }
     }
+
+    extensions = blocaled_locale1_extensions_skeleton_new ();
+
+    g_signal_connect (extensions, "handle-list-locales", G_CALLBACK (on_handle_list_locales), NULL);
+    g_signal_connect (extensions, "handle-list-vconsole-keymaps", G_CALLBACK (on_handle_list_vconsole_keymaps), NULL);
+    g_signal_connect (extensions, "handle-list-x11-layouts", G_CALLBACK (on_handle_list_x11_layouts), NULL);
+    g_signal_connect (extensions, "handle-set-locale-variables", G_CALLBACK (on_handle_set_locale_variables), NULL);
+    g_signal_connect (extensions, "handle-set-all", G_CALLBACK (on_handle_set_all), NULL);
+
+    if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (extensions),
+                                           connection,
+                                           "/org/freedesktop/locale1",
+                                           &err)) {
+        if (err != NULL) {
+            g_critical ("Failed to export interface on /org/freedesktop/locale1: %s", err->message);
+            localed_exit (1);
+        }
+    }
+
+    stats = blocaled_locale1_stats_skeleton_new ();
+
+    g_signal_connect (stats, "handle-get-counters", G_CALLBACK (on_handle_get_counters), NULL);
+    g_signal_connect (stats, "handle-get-histograms", G_CALLBACK (on_handle_get_histograms), NULL);
+
+    if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (stats),
+                                           connection,
+                                           "/org/freedesktop/locale1",
+                                           &err)) {
+        if (err != NULL) {
+            g_critical ("Failed to export interface on /org/freedesktop/locale1: %s", err->message);
+            localed_exit (1);
+        }
+    }
+
+    if (private_socket != NULL) {
+        GDBusInterfaceSkeleton *skeletons[] = {
+            G_DBUS_INTERFACE_SKELETON (locale1),
+            G_DBUS_INTERFACE_SKELETON (extensions),
+            G_DBUS_INTERFACE_SKELETON (stats),
+            NULL
+        };
+
+        /* Not fatal: the clients can still use the bus */
+        if (!peer_server_start (private_socket, "/org/freedesktop/locale1", skeletons, &err)) {
+            g_warning ("Failed to listen on %s: %s", private_socket, err->message);
+            g_clear_error (&err);
+        }
+    }
+
+    settings_watch_start ();
+    startup_exported = g_get_monotonic_time ();
 }
 
 static void
@@ -1321,7 +3405,9 @@ on_name_acquired (GDBusConnection *connection,
                   gpointer         user_data)
 {
     g_debug ("Acquired the name %s", bus_name);
+    startup_log_timing ();
     localed_started ();
+    idle_timer_restart ();
 }
 
 static void
@@ -1336,6 +3422,191 @@ on_name_lost (GDBusConnection *connection,
     localed_exit (1);
 }
 
+/**
+ * localed_set_strict_locale:
+ * @strict: whether SetLocale accepts only installed locales
+ *
+ * Enable or disable checking the requested locales against the index of
+ * installed locales (see #locale_index_contains). Disabled by default.
+ */
+
+void
+localed_set_strict_locale (gboolean strict)
+{
+    strict_locale = strict;
+}
+
+/**
+ * localed_set_strict_keyboard:
+ * @strict: whether SetVConsoleKeyboard and SetX11Keyboard accept only
+ * installed keymaps and known X11 keyboard settings
+ *
+ * Enable or disable checking the requested keymaps against the keymap
+ * index, and the X11 keyboard settings against the xkb index. Disabled
+ * by default.
+ */
+
+void
+localed_set_strict_keyboard (gboolean strict)
+{
+    strict_keyboard = strict;
+}
+
+/**
+ * localed_set_lazy_load:
+ * @lazy: whether the settings files are only read when first needed
+ *
+ * In lazy mode, a settings file is not read at start, but when one of
+ * its properties is first asked for, or a method needs it. Disabled by
+ * default.
+ */
+
+void
+localed_set_lazy_load (gboolean lazy)
+{
+    lazy_load = lazy;
+}
+
+/**
+ * localed_set_private_socket:
+ * @path: name of the unix socket on which the interfaces are also
+ * exported, or %NULL
+ *
+ * Local clients may connect to @path instead of going through the
+ * system bus. Must be called before #localed_init. Disabled by default.
+ */
+
+void
+localed_set_private_socket (const gchar *path)
+{
+    g_free (private_socket);
+    private_socket = g_strdup (path);
+}
+
+/**
+ * localed_set_state_file:
+ * @path: where to publish the settings for readers using
+ * blocaled-shm.h, or %NULL
+ *
+ * Must be called before #localed_init. Disabled by default. Since all
+ * the settings are published, they are all read at start, even in lazy
+ * mode.
+ */
+
+void
+localed_set_state_file (const gchar *path)
+{
+    g_free (state_file);
+    state_file = g_strdup (path);
+}
+
+/**
+ * localed_set_idle_exit:
+ * @timeout: number of seconds without request after which blocaled exits,
+ * 0 to never exit
+ * @_snapshot_file: where the settings are saved at exit, and read at
+ * start, if @timeout is not 0
+ *
+ * Enable or disable exiting when idle. Disabled by default.
+ */
+
+void
+localed_set_idle_exit (guint timeout,
+                       const gchar *_snapshot_file)
+{
+    idle_timeout = timeout;
+    g_clear_pointer (&snapshot_file, g_free);
+    if (timeout != 0)
+        snapshot_file = g_strdup (_snapshot_file);
+    /* Before the interface is exported, on_name_acquired starts the timer */
+    if (locale1 != NULL)
+        idle_timer_restart ();
+}
+
+/*
+ * settings_file_replace:
+ * @file: one of locale_file, keymaps_file or x11_file
+ * @path: the new name of the file
+ *
+ * Returns: TRUE if @file was changed. Must be called with the lock of
+ * the file held.
+ */
+
+static gboolean
+settings_file_replace (GFile **file,
+                       const gchar *path)
+{
+    GFile *new_file;
+
+    new_file = g_file_new_for_path (path);
+    if (g_file_equal (*file, new_file)) {
+        g_object_unref (new_file);
+        return FALSE;
+    }
+    g_debug ("Using '%s' instead of '%s'", path, g_file_peek_path (*file));
+    g_object_unref (*file);
+    *file = new_file;
+    return TRUE;
+}
+
+/**
+ * localed_set_files:
+ * @localeconfig: name of the file containing locale settings
+ * @keyboardconfig: name of the file containing virtual console keyboard layout
+ * @xkbdconfig: name of the file containing X11 keyboard configuration
+ *
+ * Change the settings files after #localed_init, as when the
+ * configuration is read again. The files that changed are read, if they
+ * were already, and the properties whose value differs are changed.
+ */
+
+void
+localed_set_files (const gchar *localeconfig,
+                   const gchar *keyboardconfig,
+                   const gchar *xkbdconfig)
+{
+    const gchar *paths[SETTINGS_N_FILES];
+    gboolean changed[SETTINGS_N_FILES];
+    gboolean watching;
+    guint i;
+
+    paths[SETTINGS_FILE_LOCALE] = localeconfig;
+    paths[SETTINGS_FILE_KEYMAPS] = keyboardconfig;
+    paths[SETTINGS_FILE_X11] = xkbdconfig;
+
+    startup_readers_join ();
+
+    G_LOCK (locale);
+    changed[SETTINGS_FILE_LOCALE] = settings_file_replace (&locale_file, localeconfig);
+    G_UNLOCK (locale);
+    G_LOCK (keymaps);
+    changed[SETTINGS_FILE_KEYMAPS] = settings_file_replace (&keymaps_file, keyboardconfig);
+    G_UNLOCK (keymaps);
+    G_LOCK (xorg_conf);
+    changed[SETTINGS_FILE_X11] = settings_file_replace (&x11_file, xkbdconfig);
+    G_UNLOCK (xorg_conf);
+
+    if (!changed[SETTINGS_FILE_LOCALE] && !changed[SETTINGS_FILE_KEYMAPS] && !changed[SETTINGS_FILE_X11])
+        return;
+
+    /* The monitors watch the previous files */
+    watching = settings_watching;
+    if (watching)
+        settings_watch_stop ();
+
+    for (i = 0; i < G_N_ELEMENTS (settings_watches); i++) {
+        struct settings_watch *watch = &settings_watches[i];
+
+        if (changed[watch->which] && settings_loaded[watch->which]) {
+            g_debug ("Reading '%s'", paths[watch->which]);
+            watch->reload ();
+        }
+    }
+
+    if (watching)
+        settings_watch_start ();
+}
+
 /**
  * localed_init:
  * @_read_only: if set, settings file cannot be written
@@ -1356,94 +3627,26 @@ localed_init (gboolean _read_only,
               const gchar *keyboardconfig,
               const gchar *xkbdconfig)
 {
-    GError *err = NULL;
-    gchar **locale_values = NULL;
-    gchar **keymap_values = NULL;
-    struct xorg_confd_parser *x11_parser = NULL;
+    gchar **var;
 
+    startup_begin = g_get_monotonic_time ();
     read_only = _read_only;
 
+    for (var = locale_variables; *var != NULL; var++)
+        g_assert (locale_variable_index (*var, strlen (*var)) == var - locale_variables);
+
+    /* Seek the polkit authority while the settings are read */
+    check_polkit_init ();
+
     kbd_model_map_file = g_file_new_for_path (kbd_model_map);
     locale_file = g_file_new_for_path (localeconfig);
     keymaps_file = g_file_new_for_path (keyboardconfig);
     x11_file = g_file_new_for_path (xkbdconfig);
 
-    locale = g_new0 (gchar *, g_strv_length (locale_variables) + 1);
-    locale_values = shell_parser_source_var_list (locale_file, (const gchar * const *)locale_variables, &err);
-    if (locale_values != NULL) {
-        gchar **variable, **value, **loc;
-        loc = locale;
-        for (variable = locale_variables, value = locale_values; *variable != NULL; variable++, value++) {
-            if (*value != NULL) {
-                *loc = g_strdup_printf ("%s=%s", *variable, *value);
-                g_free (*value);
-                loc++;
-            }
-        }
-            
-        g_free (locale_values);
-    }
-    if (err != NULL) {
-        g_debug ("%s", err->message);
-        g_clear_error (&err);
-    }
-
-    vconsole_keymap = vconsole_keymap_toggle = NULL;
-    keymap_values = shell_parser_source_var_list (
-                               keymaps_file,
-                               (const gchar * const *)keymap_variables,
-			       &err);
-    if (keymap_values != NULL) {
-        if (keymap_values[0] != NULL) {
-            if (keymap_values[1] != NULL) {
-                g_debug("Both KEYMAP and keymap are set in %s; keeping KEYMAP",
-                         keyboardconfig);
-                g_free (keymap_values[1]);
-	    }
-            vconsole_keymap = g_strdup(keymap_values[0]);
-            g_free (keymap_values[0]);
-        } else if (keymap_values[1] != NULL) {
-            vconsole_keymap = g_strdup(keymap_values[1]);
-            keymap_var = "keymap";
-            toggle_var = NULL;
-            g_free (keymap_values[1]);
-        }
-        if (keymap_values[2] != NULL) {
-            if (keymap_values[3] != NULL) {
-                g_debug("Both KEYMAP_TOGGLE and KEYMAP_CORRECTIONS are set in %s; keeping KEYMAP_TOGGLE",
-                         keyboardconfig);
-                g_free (keymap_values[3]);
-	    }
-            vconsole_keymap_toggle = g_strdup(keymap_values[2]);
-            g_free (keymap_values[2]);
-        } else if (keymap_values[3] != NULL) {
-            vconsole_keymap_toggle = g_strdup(keymap_values[3]);
-            toggle_var = "KEYMAP_CORRECTIONS";
-            g_free (keymap_values[3]);
-        }
-        g_free (keymap_values);
-    }
-    if (vconsole_keymap == NULL)
-        vconsole_keymap = g_strdup ("");
-    if (vconsole_keymap_toggle == NULL)
-        vconsole_keymap_toggle = g_strdup ("");
-    if (err != NULL) {
-        g_debug ("%s", err->message);
-        g_clear_error (&err);
-    }
-
     kbd_model_map_regex_init ();
     xorg_confd_regex_init ();
 
-    x11_parser = xorg_confd_parser_new (x11_file, FALSE, &err);
-
-    if (x11_parser != NULL) {
-        xorg_confd_parser_get_xkb (x11_parser, &x11_layout, &x11_model, &x11_variant, &x11_options);
-        xorg_confd_parser_free (x11_parser);
-    } else {
-        g_debug ("%s", err->message);
-        g_clear_error (&err);
-    }
+    startup_readers_start ();
 
     bus_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
                              "org.freedesktop.locale1",
@@ -1465,9 +3668,34 @@ localed_init (gboolean _read_only,
 void
 localed_destroy (void)
 {
-    g_bus_unown_name (bus_id);
+    /* In case the bus could not be reached */
+    startup_readers_join ();
+    settings_watch_stop ();
+    if (idle_timeout_id != 0) {
+        g_source_remove (idle_timeout_id);
+        idle_timeout_id = 0;
+    }
+    if (idle_exit_id != 0) {
+        g_source_remove (idle_exit_id);
+        idle_exit_id = 0;
+    }
+    idle_exiting = FALSE;
+    snapshot_save ();
+    g_clear_pointer (&snapshot_file, g_free);
+    peer_server_stop ();
+    g_clear_pointer (&private_socket, g_free);
+    if (state_publish_id != 0) {
+        g_source_remove (state_publish_id);
+        state_publish_id = 0;
+    }
+    state_shm_close ();
+    g_clear_pointer (&state_file, g_free);
+    /* Already released when exiting on idle */
+    if (bus_id != 0)
+        g_bus_unown_name (bus_id);
     bus_id = 0;
     read_only = FALSE;
+    check_polkit_destroy ();
     g_strfreev (locale);
     kbd_model_map_regex_destroy ();
     xorg_confd_regex_destroy ();
@@ -1482,4 +3710,7 @@ localed_destroy (void)
     g_object_unref (keymaps_file);
     g_object_unref (x11_file);
     g_object_unref (kbd_model_map_file);
+
+    /* Do not exit before the deferred syncs are done */
+    file_transaction_flush ();
 }
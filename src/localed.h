@@ -35,9 +35,10 @@
  * - interaction with D-Bus
  * - calling polkit for authorization
  *
- * Only two functions are public: #localed_init to initiate the connection
- * with D-Bus and readd the settings from files, and #localed_destoy, for
- * garbage collection at exit.
+ * The public functions are #localed_init to initiate the connection
+ * with D-Bus and readd the settings from files, #localed_destoy, for
+ * garbage collection at exit, and setters for the options which are
+ * called before #localed_init.
  */
 
 void
@@ -47,6 +48,30 @@ localed_init (gboolean _read_only,
 	      const gchar *keyboardconfig,
 	      const gchar *xkbdconfig);
 
+void
+localed_set_strict_locale (gboolean strict);
+
+void
+localed_set_strict_keyboard (gboolean strict);
+
+void
+localed_set_lazy_load (gboolean lazy);
+
+void
+localed_set_private_socket (const gchar *path);
+
+void
+localed_set_state_file (const gchar *path);
+
+void
+localed_set_idle_exit (guint timeout,
+                       const gchar *snapshot_file);
+
+void
+localed_set_files (const gchar *localeconfig,
+                   const gchar *keyboardconfig,
+                   const gchar *xkbdconfig);
+
 void
 localed_destroy (void);
 
@@ -0,0 +1,289 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fileindex.h"
+#include "localeindex.h"
+
+#include "config.h"
+
+static FileIndex *locale_index = NULL;
+static gchar *locale_dir = NULL;
+static gchar *alias_file = NULL;
+
+/*
+  Layout of the glibc locale archive (see locarchive.h in glibc). All the
+  offsets are from the start of the file. The names in the hash table are
+  already normalized.
+*/
+
+#define LOCALE_ARCHIVE_MAGIC 0xde020109
+
+struct locale_archive_header {
+    uint32_t magic;
+    uint32_t serial;
+    uint32_t namehash_offset;
+    uint32_t namehash_used;
+    uint32_t namehash_size;
+    uint32_t string_offset;
+    uint32_t string_used;
+    uint32_t string_size;
+    uint32_t locrectab_offset;
+    uint32_t locrectab_used;
+    uint32_t locrectab_size;
+    uint32_t sumhash_offset;
+    uint32_t sumhash_used;
+    uint32_t sumhash_size;
+};
+
+struct locale_archive_name {
+    uint32_t hashval;
+    uint32_t name_offset;   /* 0 for an empty slot */
+    uint32_t locrec_offset;
+};
+
+/*
+ * normalize_locale_name:
+ * @name: a locale name, language[_territory][.codeset][@modifier]
+ *
+ * Normalize the codeset as glibc does: only the lower case letters and
+ * the digits are kept, and "iso" is prepended if only digits remain.
+ *
+ * Returns: the normalized name, newly allocated
+ */
+
+static gchar *
+normalize_locale_name (const gchar *name)
+{
+    const gchar *dot, *at, *p;
+    GString *ret;
+    gboolean only_digits = TRUE;
+
+    at = strchr (name, '@');
+    dot = strchr (name, '.');
+    if (dot == NULL || (at != NULL && at < dot))
+        return g_strdup (name);
+
+    ret = g_string_new_len (name, dot - name + 1);
+    for (p = dot + 1; *p != '\0' && p != at; p++)
+        if (g_ascii_isalpha (*p))
+            only_digits = FALSE;
+    if (only_digits)
+        g_string_append (ret, "iso");
+    for (p = dot + 1; *p != '\0' && p != at; p++)
+        if (g_ascii_isalnum (*p))
+            g_string_append_c (ret, g_ascii_tolower (*p));
+    if (at != NULL)
+        g_string_append (ret, at);
+    return g_string_free (ret, FALSE);
+}
+
+static void
+add_archive_locales (GHashTable *set,
+                     const gchar *archive)
+{
+    GMappedFile *mapped;
+    const gchar *contents;
+    gsize length;
+    const struct locale_archive_header *header;
+    const struct locale_archive_name *names;
+    guint32 i;
+
+    if ((mapped = g_mapped_file_new (archive, FALSE, NULL)) == NULL)
+        return;
+
+    contents = g_mapped_file_get_contents (mapped);
+    length = g_mapped_file_get_length (mapped);
+    header = (const struct locale_archive_header *) contents;
+    if (length < sizeof (struct locale_archive_header) ||
+        header->magic != LOCALE_ARCHIVE_MAGIC ||
+        header->namehash_offset > length ||
+        header->namehash_size > (length - header->namehash_offset) / sizeof (struct locale_archive_name)) {
+        g_debug ("'%s' is not a valid locale archive", archive);
+        goto out;
+    }
+
+    names = (const struct locale_archive_name *) (contents + header->namehash_offset);
+    for (i = 0; i < header->namehash_size; i++) {
+        guint32 offset = names[i].name_offset;
+
+        if (offset == 0 || names[i].locrec_offset == 0 || offset >= length ||
+            memchr (contents + offset, '\0', length - offset) == NULL)
+            continue;
+        g_hash_table_add (set, g_strdup (contents + offset));
+    }
+
+  out:
+    g_mapped_file_unref (mapped);
+}
+
+static void
+add_directory_locales (GHashTable *set,
+                       const gchar *directory)
+{
+    GDir *dir;
+    const gchar *name;
+
+    if ((dir = g_dir_open (directory, 0, NULL)) == NULL)
+        return;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        gchar *ctype = g_build_filename (directory, name, "LC_CTYPE", NULL);
+
+        if (g_file_test (ctype, G_FILE_TEST_IS_REGULAR))
+            g_hash_table_add (set, normalize_locale_name (name));
+        g_free (ctype);
+    }
+    g_dir_close (dir);
+}
+
+/* An alias is only added if it points to an installed locale */
+static void
+add_alias_locales (GHashTable *set,
+                   const gchar *aliases)
+{
+    gchar *contents = NULL;
+    gchar **lines, **line;
+
+    if (!g_file_get_contents (aliases, &contents, NULL, NULL))
+        return;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        gchar **fields;
+        gchar *target;
+
+        g_strstrip (*line);
+        if (**line == '#' || **line == '\0')
+            continue;
+        fields = g_strsplit_set (*line, " \t", 2);
+        if (fields[0] != NULL && fields[1] != NULL) {
+            target = normalize_locale_name (g_strstrip (fields[1]));
+            if (g_hash_table_contains (set, target))
+                g_hash_table_add (set, g_strdup (fields[0]));
+            g_free (target);
+        }
+        g_strfreev (fields);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+}
+
+static void
+build_locale_index (GHashTable *set,
+                    gpointer user_data)
+{
+    gchar *archive = g_build_filename (locale_dir, "locale-archive", NULL);
+
+    add_archive_locales (set, archive);
+    add_directory_locales (set, locale_dir);
+    add_alias_locales (set, alias_file);
+    g_free (archive);
+}
+
+/**
+ * locale_index_init:
+ * @_locale_dir: the directory holding the locale archive and the compiled
+ * locales, normally %LOCALE_INDEX_DEFAULT_DIR
+ * @_alias_file: the locale aliases file, normally
+ * %LOCALE_INDEX_DEFAULT_ALIAS
+ *
+ * Prepare the index. Nothing is read before the first lookup.
+ */
+
+void
+locale_index_init (const gchar *_locale_dir,
+                   const gchar *_alias_file)
+{
+    const gchar *watched[3];
+
+    locale_dir = g_strdup (_locale_dir);
+    alias_file = g_strdup (_alias_file);
+    /* Watching the directory also catches the archive being replaced */
+    watched[0] = locale_dir;
+    watched[1] = alias_file;
+    watched[2] = NULL;
+    locale_index = file_index_new ("Locale", watched, build_locale_index, NULL);
+}
+
+/**
+ * locale_index_contains:
+ * @name: a locale name
+ *
+ * Check whether @name is an installed locale. "C" and "POSIX" are always
+ * available, with any codeset, and an empty name means unset.
+ *
+ * Returns: %TRUE if @name is available
+ */
+
+gboolean
+locale_index_contains (const gchar *name)
+{
+    gchar *normalized;
+    gboolean ret;
+
+    if (*name == '\0' || !strcmp (name, "POSIX") || !strcmp (name, "C") ||
+        g_str_has_prefix (name, "C.") || g_str_has_prefix (name, "C@"))
+        return TRUE;
+    g_assert (locale_index != NULL);
+    if (file_index_contains (locale_index, name))
+        return TRUE;
+    normalized = normalize_locale_name (name);
+    ret = file_index_contains (locale_index, normalized);
+    g_free (normalized);
+    return ret;
+}
+
+/**
+ * locale_index_list:
+ *
+ * Returns: a sorted, %NULL terminated, vector of the installed locales
+ * and aliases, not including "C" and "POSIX". Free with g_strfreev.
+ */
+
+gchar **
+locale_index_list (void)
+{
+    g_assert (locale_index != NULL);
+    return file_index_list (locale_index);
+}
+
+/**
+ * locale_index_destroy:
+ *
+ * Free the index
+ */
+
+void
+locale_index_destroy (void)
+{
+    g_clear_pointer (&locale_index, file_index_free);
+    g_clear_pointer (&locale_dir, g_free);
+    g_clear_pointer (&alias_file, g_free);
+}
@@ -0,0 +1,59 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _LOCALE_INDEX_H_
+#define _LOCALE_INDEX_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: localeindex
+ * @short_description: Index of the installed locales
+ * @title: Locale Index
+ * @include: localeindex.h
+ *
+ * The installed locales are found in the glibc locale archive, in the
+ * locale directories (compiled with localedef --no-archive), and in the
+ * aliases file. Names are compared after normalizing the codeset as
+ * glibc does, so that "en_US.UTF-8" matches "en_US.utf8".
+ */
+
+#define LOCALE_INDEX_DEFAULT_DIR "/usr/lib/locale"
+#define LOCALE_INDEX_DEFAULT_ALIAS "/usr/share/locale/locale.alias"
+
+void
+locale_index_init (const gchar *locale_dir,
+                   const gchar *alias_file);
+
+gboolean
+locale_index_contains (const gchar *name);
+
+gchar **
+locale_index_list (void);
+
+void
+locale_index_destroy (void);
+
+#endif
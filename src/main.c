@@ -34,14 +34,23 @@
 #include <glib-unix.h>
 #include <gio/gio.h>
 
+#include "filetransaction.h"
+#include "keymapindex.h"
 #include "localed.h"
+#include "localeindex.h"
+#include "polkitasync.h"
 #include "shellparser.h"
+#include "stats.h"
+#include "trace.h"
+#include "xkbindex.h"
 
 #include "config.h"
 
 #define DEFAULT_LEVELS (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING | G_LOG_LEVEL_MESSAGE)
 
 static gboolean debug = FALSE;
+static const gchar *debug_domains = NULL;  /* G_MESSAGES_DEBUG, read once */
+gint trace_enabled = FALSE;
 static gboolean foreground = FALSE;
 static gboolean use_syslog = FALSE;
 static gboolean read_only = FALSE;
@@ -86,12 +95,10 @@ log_handler (const gchar *log_domain,
              const gchar *message,
              gpointer user_data)
 {
-    const gchar *debug_domains = NULL;
     GString *result = NULL;
     gchar *result_data = NULL;
 
-    debug_domains = g_getenv ("G_MESSAGES_DEBUG");
-    if (!debug && !(log_level & DEFAULT_LEVELS) && g_strcmp0 (debug_domains, "all") && strstr0 (debug_domains, log_domain) == NULL)
+    if (!(log_level & DEFAULT_LEVELS) && !TRACE_ENABLED () && strstr0 (debug_domains, log_domain) == NULL)
         return;
 
     result = g_string_new (NULL);
@@ -152,6 +159,20 @@ on_signal (gpointer user_data)
     return TRUE;
 }
 
+/*
+ * on_sigusr1:
+ * @user_data: data defined when registering the signal (unused)
+ *
+ * Called when a SIGUSR1 signal is received: log the internal counters
+ */
+
+static gboolean
+on_sigusr1 (gpointer user_data)
+{
+    stats_log ();
+    return TRUE;
+}
+
 /**
  * localed_exit:
  * @status: exit code
@@ -194,6 +215,317 @@ localed_started ()
     g_free (pidstring);
 }
 
+/*
+ * The settings read from the configuration file. All the strings are
+ * owned, and set to the built-in defaults if absent.
+ */
+
+struct config {
+    gchar *localeconfig;
+    gchar *keyboardconfig;
+    gchar *xkbdconfig;
+    FileTransactionDurability durability;
+    guint auth_cache_ttl;
+    guint polkit_timeout;
+    guint idle_timeout;
+    gboolean strict_locale;
+    gboolean strict_keyboard;
+    gboolean lazy_load;
+    gchar *locale_dir;
+    gchar *locale_alias;
+    gchar *keymap_dir;
+    gchar *xkb_rules;
+    gchar *private_socket;   /* NULL if disabled */
+    gchar *state_file;       /* NULL if disabled */
+    gchar *stats_textfile;   /* NULL if disabled */
+};
+
+static struct config current_config = { 0 };
+static gchar *snapshot_file = NULL;
+
+/*
+ * get_seconds_setting:
+ * @key_file: the configuration
+ * @key: the key to read in the settings group
+ * @value: (out): where to store the value, left unchanged if @key is absent
+ *
+ * Read a non negative number of seconds from the configuration
+ *
+ * Returns: %FALSE if the value is invalid, %TRUE otherwise
+ */
+
+static gboolean
+get_seconds_setting (GKeyFile *key_file,
+                     const gchar *key,
+                     guint *value)
+{
+    GError *error = NULL;
+    gint seconds;
+
+    seconds = g_key_file_get_integer (key_file, "settings", key, &error);
+    if (error != NULL) {
+        if (error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_clear_error (&error);
+            return TRUE;
+        }
+        g_critical ("Invalid %s in %s: %s", key, config_file, error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    if (seconds < 0) {
+        g_critical ("Invalid %s in %s: must not be negative", key, config_file);
+        return FALSE;
+    }
+    *value = seconds;
+    return TRUE;
+}
+
+/*
+ * get_boolean_setting:
+ * @key_file: the configuration
+ * @key: the key to read in the settings group
+ * @value: (out): where to store the value, left unchanged if @key is absent
+ *
+ * Read a boolean, such as strictlocale, from the configuration
+ *
+ * Returns: %FALSE if the value is invalid, %TRUE otherwise
+ */
+
+static gboolean
+get_boolean_setting (GKeyFile *key_file,
+                     const gchar *key,
+                     gboolean *value)
+{
+    GError *error = NULL;
+    gboolean result;
+
+    result = g_key_file_get_boolean (key_file, "settings", key, &error);
+    if (error != NULL) {
+        if (error->code == G_KEY_FILE_ERROR_KEY_NOT_FOUND) {
+            g_clear_error (&error);
+            return TRUE;
+        }
+        g_critical ("Invalid %s in %s: %s", key, config_file, error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    *value = result;
+    return TRUE;
+}
+
+/*
+ * config_clear:
+ * @config: a configuration
+ *
+ * Free the strings of @config
+ */
+
+static void
+config_clear (struct config *config)
+{
+    g_clear_pointer (&config->localeconfig, g_free);
+    g_clear_pointer (&config->keyboardconfig, g_free);
+    g_clear_pointer (&config->xkbdconfig, g_free);
+    g_clear_pointer (&config->locale_dir, g_free);
+    g_clear_pointer (&config->locale_alias, g_free);
+    g_clear_pointer (&config->keymap_dir, g_free);
+    g_clear_pointer (&config->xkb_rules, g_free);
+    g_clear_pointer (&config->private_socket, g_free);
+    g_clear_pointer (&config->state_file, g_free);
+    g_clear_pointer (&config->stats_textfile, g_free);
+}
+
+/*
+ * config_load:
+ * @config: (out): where to store the configuration
+ *
+ * Read config_file. A missing file means the built-in defaults. On
+ * failure, the reason is logged and @config is left cleared.
+ *
+ * Returns: %TRUE on success
+ */
+
+static gboolean
+config_load (struct config *config)
+{
+    GError *error = NULL;
+    GKeyFile *key_file = g_key_file_new ();
+    gchar *durability_string = NULL;
+    gboolean ret = FALSE;
+
+    memset (config, 0, sizeof (struct config));
+    config->durability = FILE_TRANSACTION_DURABILITY_FULL;
+
+    if (!g_key_file_load_from_file (key_file, config_file, G_KEY_FILE_NONE, &error)) {
+        if (error->domain != G_FILE_ERROR || error->code != G_FILE_ERROR_NOENT) {
+            g_critical ("Failed to parse configuration: %s", error->message);
+            goto out;
+        }
+        g_clear_error (&error);
+    } else {
+        config->localeconfig = g_key_file_get_value (key_file, "settings", "localefile", &error);
+        if (error != NULL) {
+            if (error->code == G_KEY_FILE_ERROR_GROUP_NOT_FOUND) {
+                g_critical ("Failed to parse configuration: %s", error->message);
+                goto out;
+            }
+            g_clear_error (&error);
+        }
+
+        config->keyboardconfig = g_key_file_get_value (key_file, "settings", "keymapfile", &error);
+        g_clear_error (&error);
+
+        config->xkbdconfig = g_key_file_get_value (key_file, "settings", "xkbdlayoutfile", &error);
+        g_clear_error (&error);
+        if (config->localeconfig == NULL &&
+            config->keyboardconfig == NULL &&
+            config->xkbdconfig == NULL) {
+            g_critical ("Failed to find a settings file in %s", config_file);
+            goto out;
+        }
+
+        durability_string = g_key_file_get_value (key_file, "settings", "durability", &error);
+        g_clear_error (&error);
+        if (durability_string != NULL &&
+            !file_transaction_durability_from_string (durability_string, &config->durability)) {
+            g_critical ("Invalid durability '%s' in %s", durability_string, config_file);
+            goto out;
+        }
+
+        if (!get_seconds_setting (key_file, "authcachettl", &config->auth_cache_ttl) ||
+            !get_seconds_setting (key_file, "polkittimeout", &config->polkit_timeout) ||
+            !get_seconds_setting (key_file, "idletimeout", &config->idle_timeout) ||
+            !get_boolean_setting (key_file, "strictlocale", &config->strict_locale) ||
+            !get_boolean_setting (key_file, "strictkeyboard", &config->strict_keyboard) ||
+            !get_boolean_setting (key_file, "lazyload", &config->lazy_load))
+            goto out;
+
+        config->locale_dir = g_key_file_get_value (key_file, "settings", "localedir", &error);
+        g_clear_error (&error);
+
+        config->locale_alias = g_key_file_get_value (key_file, "settings", "localealias", &error);
+        g_clear_error (&error);
+
+        config->keymap_dir = g_key_file_get_value (key_file, "settings", "keymapdir", &error);
+        g_clear_error (&error);
+
+        config->xkb_rules = g_key_file_get_value (key_file, "settings", "xkbrules", &error);
+        g_clear_error (&error);
+
+        config->private_socket = g_key_file_get_value (key_file, "settings", "privatesocket", &error);
+        g_clear_error (&error);
+        if (config->private_socket != NULL && *config->private_socket == '\0')
+            g_clear_pointer (&config->private_socket, g_free);
+
+        config->state_file = g_key_file_get_value (key_file, "settings", "statefile", &error);
+        g_clear_error (&error);
+        if (config->state_file != NULL && *config->state_file == '\0')
+            g_clear_pointer (&config->state_file, g_free);
+
+        config->stats_textfile = g_key_file_get_value (key_file, "settings", "statstextfile", &error);
+        g_clear_error (&error);
+        if (config->stats_textfile != NULL && *config->stats_textfile == '\0')
+            g_clear_pointer (&config->stats_textfile, g_free);
+    }
+    if (config->localeconfig == NULL) config->localeconfig = g_strdup (LOCALECONFIG);
+    if (config->keyboardconfig == NULL) config->keyboardconfig = g_strdup (KEYBOARDCONFIG);
+    if (config->xkbdconfig == NULL) config->xkbdconfig = g_strdup (XKBDCONFIG);
+    if (config->locale_dir == NULL) config->locale_dir = g_strdup (LOCALE_INDEX_DEFAULT_DIR);
+    if (config->locale_alias == NULL) config->locale_alias = g_strdup (LOCALE_INDEX_DEFAULT_ALIAS);
+    if (config->keymap_dir == NULL) config->keymap_dir = g_strdup (KEYMAP_INDEX_DEFAULT_DIR);
+    if (config->xkb_rules == NULL) config->xkb_rules = g_strdup (XKB_INDEX_DEFAULT_RULES);
+    ret = TRUE;
+
+  out:
+    if (!ret)
+        config_clear (config);
+    g_free (durability_string);
+    g_key_file_free (key_file);
+    return ret;
+}
+
+/*
+ * config_apply:
+ * @config: the configuration to use
+ * @previous: the configuration in use, or %NULL at start
+ *
+ * Pass @config to the modules. At start, this is done before
+ * #localed_init. Otherwise, only the indexes whose files changed are
+ * built again, and the settings files are changed with
+ * #localed_set_files. The lazyload, privatesocket and statefile
+ * settings only take effect at start.
+ */
+
+static void
+config_apply (const struct config *config,
+              const struct config *previous)
+{
+    file_transaction_set_durability (config->durability);
+    check_polkit_set_cache_ttl (config->auth_cache_ttl);
+    check_polkit_set_timeout (config->polkit_timeout);
+    if (previous == NULL ||
+        g_strcmp0 (config->locale_dir, previous->locale_dir) ||
+        g_strcmp0 (config->locale_alias, previous->locale_alias)) {
+        if (previous != NULL)
+            locale_index_destroy ();
+        locale_index_init (config->locale_dir, config->locale_alias);
+    }
+    if (previous == NULL || g_strcmp0 (config->keymap_dir, previous->keymap_dir)) {
+        if (previous != NULL)
+            keymap_index_destroy ();
+        keymap_index_init (config->keymap_dir);
+    }
+    if (previous == NULL || g_strcmp0 (config->xkb_rules, previous->xkb_rules)) {
+        if (previous != NULL)
+            xkb_index_destroy ();
+        xkb_index_init (config->xkb_rules);
+    }
+    localed_set_strict_locale (config->strict_locale);
+    localed_set_strict_keyboard (config->strict_keyboard);
+    localed_set_idle_exit (config->idle_timeout, snapshot_file);
+    if (previous == NULL || g_strcmp0 (config->stats_textfile, previous->stats_textfile))
+        stats_set_textfile (config->stats_textfile);
+    if (previous == NULL) {
+        localed_set_lazy_load (config->lazy_load);
+        localed_set_private_socket (config->private_socket);
+        localed_set_state_file (config->state_file);
+    } else {
+        if (config->lazy_load != previous->lazy_load)
+            g_message ("The lazyload setting will be used at the next start");
+        if (g_strcmp0 (config->private_socket, previous->private_socket))
+            g_message ("The privatesocket setting will be used at the next start");
+        if (g_strcmp0 (config->state_file, previous->state_file))
+            g_message ("The statefile setting will be used at the next start");
+        localed_set_files (config->localeconfig,
+                           config->keyboardconfig,
+                           config->xkbdconfig);
+    }
+}
+
+/*
+ * on_sighup:
+ * @user_data: data defined when registering the signal (unused)
+ *
+ * Called when a SIGHUP signal is received: read the configuration
+ * again. If it cannot be read, the current one is kept.
+ */
+
+static gboolean
+on_sighup (gpointer user_data)
+{
+    struct config config;
+
+    g_debug ("Reading %s again", config_file);
+    if (!config_load (&config)) {
+        g_warning ("Keeping the current configuration");
+        return TRUE;
+    }
+    config_apply (&config, &current_config);
+    config_clear (&current_config);
+    current_config = config;
+    return TRUE;
+}
+
 /**
  * PROGRAM: blocaled
  * @short_description: locale settings D-Bus service
@@ -222,16 +554,14 @@ main (gint argc, gchar *argv[])
     GOptionContext *option_context;
     pid_t pid;
     gchar *kbd_model_map = PKGDATADIR "/kbd-model-map";
-    gchar *localeconfig = NULL;
-    gchar *keyboardconfig = NULL;
-    gchar *xkbdconfig = NULL;
+    gchar *run_dir = NULL;
     GFile *pidfile = NULL;
     guint sighup_id = 0;
     guint sigint_id = 0;
     guint sigterm_id = 0;
+    guint sigusr1_id = 0;
 
-    GKeyFile *key_file = g_key_file_new();
-
+    debug_domains = g_getenv ("G_MESSAGES_DEBUG");
     g_log_set_default_handler (log_handler, NULL);
 
     option_context = g_option_context_new ("- locale settings D-Bus service");
@@ -240,6 +570,7 @@ main (gint argc, gchar *argv[])
         g_critical ("Failed to parse options: %s", error->message);
         return 1;
     }
+    g_atomic_int_set (&trace_enabled, debug || g_strcmp0 (debug_domains, "all") == 0);
 
     if (print_version) {
         g_print ("%s\n", PACKAGE_STRING);
@@ -254,38 +585,8 @@ main (gint argc, gchar *argv[])
         return 1;
     }
 
-    if (!g_key_file_load_from_file(key_file, config_file, G_KEY_FILE_NONE, &error)) {
-        if (error->domain != G_FILE_ERROR || error->code != G_FILE_ERROR_NOENT) {
-            g_critical ("Failed to parse configuration: %s", error->message);
-            return 1;
-        } else
-            g_clear_error (&error);
-    } else {
-        localeconfig = g_key_file_get_value (key_file, "settings", "localefile", &error);
-        if (error != NULL) {
-            if (error->code == G_KEY_FILE_ERROR_GROUP_NOT_FOUND) {
-
-                g_critical ("Failed to parse configuration: %s", error->message);
-                return 1;
-            } else
-                g_clear_error (&error);
-        }
-
-        keyboardconfig = g_key_file_get_value (key_file, "settings", "keymapfile", &error);
-        g_clear_error (&error);
-
-        xkbdconfig = g_key_file_get_value (key_file, "settings", "xkbdlayoutfile", &error);
-        g_clear_error (&error);
-        if (localeconfig == NULL &&
-            keyboardconfig == NULL &&
-            xkbdconfig == NULL) {
-            g_critical ("Failed to find a settings file in %s", config_file);
-	    return 1;
-        }
-    }
-    if (localeconfig == NULL) localeconfig = LOCALECONFIG;
-    if (keyboardconfig == NULL) keyboardconfig = KEYBOARDCONFIG;
-    if (xkbdconfig == NULL) xkbdconfig = XKBDCONFIG;
+    if (!config_load (&current_config))
+        return 1;
 
     if (!foreground) {
         if (daemon_retval_init () < 0) {
@@ -320,10 +621,14 @@ main (gint argc, gchar *argv[])
  */
     umask (022);
 
+    /* The snapshot is kept next to the PID file */
+    run_dir = g_path_get_dirname (PIDFILE);
+    snapshot_file = g_build_filename (run_dir, "blocaled.snapshot", NULL);
+    config_apply (&current_config, NULL);
     shell_parser_init ();
     loop = g_main_loop_new (NULL, FALSE);
     sighup_id = g_unix_signal_add (SIGHUP,
-                                   on_signal,
+                                   on_sighup,
                                    NULL);
     sigint_id = g_unix_signal_add (SIGINT,
                                    on_signal,
@@ -331,11 +636,14 @@ main (gint argc, gchar *argv[])
     sigterm_id = g_unix_signal_add (SIGTERM,
                                    on_signal,
                                    NULL);
+    sigusr1_id = g_unix_signal_add (SIGUSR1,
+                                    on_sigusr1,
+                                    NULL);
     localed_init (read_only,
 		  kbd_model_map,
-		  localeconfig,
-		  keyboardconfig,
-		  xkbdconfig);
+		  current_config.localeconfig,
+		  current_config.keyboardconfig,
+		  current_config.xkbdconfig);
     g_main_loop_run (loop);
 
     g_main_loop_unref (loop);
@@ -347,10 +655,19 @@ main (gint argc, gchar *argv[])
     g_source_remove (sighup_id);
     g_source_remove (sigint_id);
     g_source_remove (sigterm_id);
+    g_source_remove (sigusr1_id);
 
     localed_destroy ();
+    /* The last values, with the syncs flushed by localed_destroy */
+    stats_set_textfile (NULL);
+    locale_index_destroy ();
+    keymap_index_destroy ();
+    xkb_index_destroy ();
     shell_parser_destroy ();
 
+    config_clear (&current_config);
+    g_free (run_dir);
+    g_free (snapshot_file);
     g_clear_error (&error);
     return exit_status;
 }
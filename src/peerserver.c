@@ -0,0 +1,224 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "peerserver.h"
+
+#include "config.h"
+
+static GDBusServer *server = NULL;
+static gchar *socket_path = NULL;
+static gchar *exported_path = NULL;
+static GPtrArray *exported = NULL;     /* the skeletons */
+static GPtrArray *connections = NULL;  /* the open peer connections */
+
+/*
+  The bus daemon only lets root call the methods which change the
+  settings, and polkit decides. Here, the socket is made private to the
+  owner, and the peers are checked again once authenticated, since the
+  permissions of the socket may be changed by someone else.
+*/
+
+static gboolean
+on_authorize_peer (GDBusAuthObserver *observer,
+                   GIOStream *stream,
+                   GCredentials *credentials,
+                   gpointer user_data)
+{
+    uid_t uid;
+
+    if (credentials == NULL ||
+        (uid = g_credentials_get_unix_user (credentials, NULL)) == (uid_t) -1)
+        return FALSE;
+    if (uid != 0 && uid != geteuid ()) {
+        g_debug ("Rejecting a peer running as uid %u", (guint) uid);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+on_allow_mechanism (GDBusAuthObserver *observer,
+                    const gchar *mechanism,
+                    gpointer user_data)
+{
+    /* Only EXTERNAL gives the credentials of the peer */
+    return !g_strcmp0 (mechanism, "EXTERNAL");
+}
+
+static void
+connection_unexport (GDBusConnection *connection)
+{
+    guint i;
+
+    for (i = 0; i < exported->len; i++)
+        g_dbus_interface_skeleton_unexport_from_connection (g_ptr_array_index (exported, i), connection);
+}
+
+static void
+on_connection_closed (GDBusConnection *connection,
+                      gboolean remote_peer_vanished,
+                      GError *error,
+                      gpointer user_data)
+{
+    g_debug ("Peer connection closed");
+    g_signal_handlers_disconnect_by_func (connection, on_connection_closed, NULL);
+    connection_unexport (connection);
+    g_ptr_array_remove (connections, connection);
+}
+
+static gboolean
+on_new_connection (GDBusServer *server,
+                   GDBusConnection *connection,
+                   gpointer user_data)
+{
+    GError *err = NULL;
+    guint i;
+
+    for (i = 0; i < exported->len; i++)
+        if (!g_dbus_interface_skeleton_export (g_ptr_array_index (exported, i),
+                                               connection,
+                                               exported_path,
+                                               &err)) {
+            g_warning ("Failed to export interface on a peer connection: %s", err->message);
+            g_clear_error (&err);
+            connection_unexport (connection);
+            return FALSE;
+        }
+
+    g_debug ("New peer connection");
+    g_ptr_array_add (connections, g_object_ref (connection));
+    g_signal_connect (connection, "closed", G_CALLBACK (on_connection_closed), NULL);
+    return TRUE;
+}
+
+/**
+ * peer_server_start:
+ * @path: the name of the socket
+ * @object_path: where to export @skeletons
+ * @skeletons: %NULL terminated array of interfaces, already exported on
+ * the bus
+ * @error: return location for an error
+ *
+ * Listen on the unix socket @path, replacing any file there, and export
+ * @skeletons on every connection.
+ *
+ * Returns: %TRUE on success
+ */
+
+gboolean
+peer_server_start (const gchar *path,
+                   const gchar *object_path,
+                   GDBusInterfaceSkeleton **skeletons,
+                   GError **error)
+{
+    GDBusAuthObserver *observer = NULL;
+    gchar *dir = NULL, *address = NULL, *guid = NULL;
+    gboolean ret = FALSE;
+    GStatBuf st;
+    mode_t mask;
+
+    g_return_val_if_fail (server == NULL, FALSE);
+
+    dir = g_path_get_dirname (path);
+    if (g_mkdir_with_parents (dir, 0755) < 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Failed to create '%s': %s", dir, g_strerror (errno));
+        goto out;
+    }
+    /* Left by a previous instance which did not stop cleanly. Anything
+       else found there is left alone, and binding fails */
+    if (g_lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+        g_unlink (path);
+
+    observer = g_dbus_auth_observer_new ();
+    g_signal_connect (observer, "authorize-authenticated-peer", G_CALLBACK (on_authorize_peer), NULL);
+    g_signal_connect (observer, "allow-mechanism", G_CALLBACK (on_allow_mechanism), NULL);
+
+    address = g_strdup_printf ("unix:path=%s", path);
+    guid = g_dbus_generate_guid ();
+    /* The socket is created with no access for group and others */
+    mask = umask (077);
+    server = g_dbus_server_new_sync (address, G_DBUS_SERVER_FLAGS_NONE, guid, observer, NULL, error);
+    umask (mask);
+    if (server == NULL)
+        goto out;
+
+    socket_path = g_strdup (path);
+    exported_path = g_strdup (object_path);
+    exported = g_ptr_array_new_with_free_func (g_object_unref);
+    for (; *skeletons != NULL; skeletons++)
+        g_ptr_array_add (exported, g_object_ref (*skeletons));
+    connections = g_ptr_array_new_with_free_func (g_object_unref);
+
+    g_signal_connect (server, "new-connection", G_CALLBACK (on_new_connection), NULL);
+    g_dbus_server_start (server);
+    g_debug ("Listening on %s", path);
+    ret = TRUE;
+
+  out:
+    g_clear_object (&observer);
+    g_free (dir);
+    g_free (address);
+    g_free (guid);
+    return ret;
+}
+
+/**
+ * peer_server_stop:
+ *
+ * Close the peer connections, stop listening and remove the socket.
+ * Does nothing if the server was not started.
+ */
+
+void
+peer_server_stop (void)
+{
+    if (server == NULL)
+        return;
+
+    g_dbus_server_stop (server);
+    g_clear_object (&server);
+    while (connections->len > 0) {
+        GDBusConnection *connection = g_ptr_array_index (connections, connections->len - 1);
+
+        g_signal_handlers_disconnect_by_func (connection, on_connection_closed, NULL);
+        connection_unexport (connection);
+        g_dbus_connection_close_sync (connection, NULL, NULL);
+        g_ptr_array_remove_index (connections, connections->len - 1);
+    }
+    g_clear_pointer (&connections, g_ptr_array_unref);
+    g_clear_pointer (&exported, g_ptr_array_unref);
+    g_unlink (socket_path);
+    g_clear_pointer (&socket_path, g_free);
+    g_clear_pointer (&exported_path, g_free);
+}
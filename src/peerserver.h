@@ -0,0 +1,54 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _PEER_SERVER_H_
+#define _PEER_SERVER_H_
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION: peerserver
+ * @short_description: Private socket for local clients
+ * @title: Peer Server
+ * @include: peerserver.h
+ *
+ * Optionally, the interfaces exported on the system bus are also
+ * exported on a unix socket, to which local clients connect directly,
+ * without going through the bus daemon. The socket can only be used by
+ * root, and by the user blocaled runs as. The methods are authorized by
+ * polkit for the process at the other end of the connection.
+ */
+
+gboolean
+peer_server_start (const gchar *path,
+                   const gchar *object_path,
+                   GDBusInterfaceSkeleton **skeletons,
+                   GError **error);
+
+void
+peer_server_stop (void);
+
+#endif
@@ -35,12 +35,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include <glib.h>
 #include <gio/gio.h>
 #include <polkit/polkit.h>
 
 #include "polkitasync.h"
+#include "probes.h"
+#include "stats.h"
 
 #include "config.h"
 
@@ -51,6 +54,14 @@
     means polkitd is not running.
   - check the authorization.
 
+  Getting the authority is an asynchronous D-Bus call by itself, so it is
+  done once, when the daemon starts (see check_polkit_init), and the
+  authority is kept for all the checks. The authority is a proxy for the
+  well-known name of polkitd, so it survives a restart of polkitd: the
+  next call just goes to the new owner (D-Bus activating it if needed).
+  Only if getting the authority failed at startup is it sought again
+  when a check is requested.
+
   For checking the authorization, we need to pass:
   - the ref to the authority (PolkitAuthority *)
   - the subject (PolkitSubject *): a type describing what is asking
@@ -61,22 +72,101 @@
   - a callback (which is called when the authorization check is complete)
   - user data (to pass to the callback).
 
-  All the above needs to be retrieved after getting the authority, in the
-  callback which is called at the end of the authority seek. So we need to
-  pack it into a struct:
+  If the authority has to be sought first, all the above needs to be
+  retrieved in the callback which is called at the end of the authority
+  seek. So we need to pack it into a struct.
+
+  The subject is the unique bus name of the caller. On a peer to peer
+  connection (see peerserver.c), there is no bus name: the subject is
+  then the process at the other end, designated by a pidfd of the
+  connection (SO_PEERPIDFD), so that polkit can not be fooled by another
+  process reusing its PID. Without pidfd support in the kernel or in
+  polkit, such checks are denied. They are never cached.
+
+  A check may take long, when the user has to enter a password. If the
+  caller disconnects meanwhile, or if the check lasts longer than the
+  configured timeout, the request is aborted: the polkit call is
+  cancelled (which also dismisses the authentication dialog), and the
+  callback is called right away with an error, so that the caller can
+  release the request. The struct is only freed when polkit returns,
+  since it is still referenced by the pending call. In between, it is
+  marked as completed, so that the result is ignored.
 */
 
 struct check_polkit_data {
-    const gchar *unique_name;
-    const gchar *action_id;
+    gchar *unique_name;    /* NULL on a peer to peer connection */
+    GDBusConnection *peer; /* the connection, if peer to peer */
+    gchar *action_id;
     gboolean user_interaction;
     GAsyncReadyCallback callback;
     gpointer user_data;
 
     PolkitAuthority *authority;
     PolkitSubject *subject;
+
+    GCancellable *cancellable;
+    guint vanished_id;     /* NameOwnerChanged subscription for the caller */
+    gulong closed_id;      /* "closed" handler on the peer connection */
+    guint timeout_id;
+    gboolean completed;    /* callback already called */
+    gint64 start;          /* for the statistics */
+    guint64 request_id;    /* for the probes */
 };
 
+static PolkitAuthority *cached_authority = NULL;
+static gulong owner_handler_id = 0;
+static gulong changed_handler_id = 0;
+static GCancellable *init_cancellable = NULL;
+
+/*
+  Optional cache of positive results. A client sending many requests over
+  the same connection then pays for polkit only once per action and per
+  TTL. The cache maps the unique bus name of the sender to a struct
+  auth_cache_sender, holding the expiry times of the actions it has been
+  authorized for. Unique names are never reused by the bus, so an entry
+  cannot be applied to another client; still, the entries of a sender are
+  dropped as soon as its name vanishes, or at once if it has already
+  vanished when it is inserted. Expired entries are swept every TTL. The
+  whole cache is dropped when polkit reports a change in its
+  configuration or temporary authorizations.
+*/
+
+struct auth_cache_sender {
+    guint subscription_id;
+    GHashTable *actions;   /* action id -> gint64 expiry (monotonic) */
+};
+
+static guint auth_cache_ttl = 0;
+static GHashTable *auth_cache = NULL;
+static guint auth_cache_sweep_id = 0;
+
+static guint check_timeout = 0;
+static GDBusConnection *system_bus = NULL;
+
+static GDBusConnection *
+get_system_bus (void)
+{
+    /* This is the connection on which the name is owned, so it is
+       already open */
+    if (system_bus == NULL)
+        system_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+    return system_bus;
+}
+
+static void
+check_polkit_stop_watching (struct check_polkit_data *data)
+{
+    if (data->vanished_id != 0 && system_bus != NULL)
+        g_dbus_connection_signal_unsubscribe (system_bus, data->vanished_id);
+    data->vanished_id = 0;
+    if (data->closed_id != 0)
+        g_signal_handler_disconnect (data->peer, data->closed_id);
+    data->closed_id = 0;
+    if (data->timeout_id != 0)
+        g_source_remove (data->timeout_id);
+    data->timeout_id = 0;
+}
+
 void
 check_polkit_data_free (struct check_polkit_data *data)
 {
@@ -87,14 +177,423 @@ check_polkit_data_free (struct check_polkit_data *data)
         g_object_unref (data->subject);
     if (data->authority != NULL)
         g_object_unref (data->authority);
+    check_polkit_stop_watching (data);
+    g_clear_object (&data->cancellable);
+    g_clear_object (&data->peer);
+    g_free (data->unique_name);
+    g_free (data->action_id);
     
     g_free (data);
 }
 
+/*
+  Calls the callback of the caller, once only: with TRUE if @err is NULL,
+  otherwise with @err, which is consumed.
+*/
+
+static void
+check_polkit_return (struct check_polkit_data *data,
+                     GError *err)
+{
+    GTask *task;
+
+    if (data->completed) {
+        g_clear_error (&err);
+        return;
+    }
+    data->completed = TRUE;
+    check_polkit_stop_watching (data);
+    stats_stage_add (STATS_STAGE_POLKIT, data->start);
+    PROBE3 (polkit__done, data->request_id, data->action_id, err == NULL);
+
+    if (err != NULL) {
+        g_task_report_error (NULL, data->callback, data->user_data, NULL, err);
+        return;
+    }
+    task = g_task_new (NULL, NULL, data->callback, data->user_data);
+    g_task_return_boolean (task, TRUE);
+//    g_simple_async_result_complete_in_idle (simple); Apparently this step
+//    not needed with GTask
+    g_object_unref (task);
+}
+
+static void
+check_polkit_abort (struct check_polkit_data *data,
+                    gint code,
+                    const gchar *reason)
+{
+    g_debug ("Authorizing '%s' for '%s': %s", data->unique_name != NULL ? data->unique_name : "peer", data->action_id, reason);
+    g_cancellable_cancel (data->cancellable);
+    check_polkit_return (data, g_error_new (G_IO_ERROR, code,
+                                            "Authorizing for '%s': %s",
+                                            data->action_id, reason));
+}
+
+static void
+on_caller_name_owner_changed (GDBusConnection *connection,
+                              const gchar *sender_name,
+                              const gchar *object_path,
+                              const gchar *interface_name,
+                              const gchar *signal_name,
+                              GVariant *parameters,
+                              gpointer user_data)
+{
+    const gchar *name, *old_owner, *new_owner;
+
+    g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (*new_owner == '\0')
+        check_polkit_abort ((struct check_polkit_data *) user_data,
+                            G_IO_ERROR_CANCELLED, "caller disconnected");
+}
+
+static void
+on_peer_closed (GDBusConnection *connection,
+                gboolean remote_peer_vanished,
+                GError *error,
+                gpointer user_data)
+{
+    check_polkit_abort ((struct check_polkit_data *) user_data,
+                        G_IO_ERROR_CANCELLED, "caller disconnected");
+}
+
+static gboolean
+on_check_timeout (gpointer user_data)
+{
+    struct check_polkit_data *data = (struct check_polkit_data *) user_data;
+
+    data->timeout_id = 0;
+    check_polkit_abort (data, G_IO_ERROR_TIMED_OUT, "timed out");
+    return G_SOURCE_REMOVE;
+}
+
+static void
+check_polkit_watch (struct check_polkit_data *data)
+{
+    GDBusConnection *connection;
+
+    if (data->peer != NULL)
+        data->closed_id = g_signal_connect (data->peer, "closed", G_CALLBACK (on_peer_closed), data);
+    else if (data->unique_name != NULL && (connection = get_system_bus ()) != NULL)
+        data->vanished_id =
+            g_dbus_connection_signal_subscribe (connection,
+                                                "org.freedesktop.DBus",
+                                                "org.freedesktop.DBus",
+                                                "NameOwnerChanged",
+                                                "/org/freedesktop/DBus",
+                                                data->unique_name,
+                                                G_DBUS_SIGNAL_FLAGS_NONE,
+                                                on_caller_name_owner_changed,
+                                                data,
+                                                NULL);
+    if (check_timeout != 0)
+        data->timeout_id = g_timeout_add_seconds (check_timeout, on_check_timeout, data);
+}
+
+/**
+ * check_polkit_set_timeout:
+ * @timeout: how long, in seconds, a check may take, 0 meaning no limit
+ *
+ * Set the time after which a pending authorization check is abandoned
+ */
+
+void
+check_polkit_set_timeout (guint timeout)
+{
+    check_timeout = timeout;
+}
+
+static void
+on_authority_owner_changed (GObject *object,
+                            GParamSpec *pspec,
+                            gpointer user_data)
+{
+    gchar *owner = polkit_authority_get_owner (POLKIT_AUTHORITY (object));
+
+    if (owner != NULL)
+        g_debug ("Polkit authority now owned by %s", owner);
+    else
+        g_debug ("Polkit authority has no owner; it will be activated on next check");
+    g_free (owner);
+}
+
+static void
+auth_cache_sender_free (struct auth_cache_sender *entry)
+{
+    if (entry == NULL)
+        return;
+
+    if (entry->subscription_id != 0 && system_bus != NULL)
+        g_dbus_connection_signal_unsubscribe (system_bus, entry->subscription_id);
+    g_hash_table_destroy (entry->actions);
+    g_free (entry);
+}
+
+static void
+auth_cache_clear (void)
+{
+    if (auth_cache != NULL)
+        g_hash_table_remove_all (auth_cache);
+}
+
+static void
+on_authority_changed (PolkitAuthority *authority,
+                      gpointer user_data)
+{
+    g_debug ("Polkit authority changed, dropping cached authorizations");
+    auth_cache_clear ();
+}
+
+static void
+on_sender_name_owner_changed (GDBusConnection *connection,
+                              const gchar *sender_name,
+                              const gchar *object_path,
+                              const gchar *interface_name,
+                              const gchar *signal_name,
+                              GVariant *parameters,
+                              gpointer user_data)
+{
+    const gchar *name, *old_owner, *new_owner;
+
+    g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (*new_owner != '\0')
+        return;
+
+    g_debug ("'%s' vanished, dropping its cached authorizations", name);
+    if (auth_cache != NULL)
+        g_hash_table_remove (auth_cache, name);
+}
+
+static gboolean
+auth_cache_lookup (const gchar *unique_name,
+                   const gchar *action_id)
+{
+    struct auth_cache_sender *entry;
+    gint64 *expiry;
+
+    if (auth_cache == NULL || unique_name == NULL || action_id == NULL)
+        return FALSE;
+
+    if ((entry = g_hash_table_lookup (auth_cache, unique_name)) != NULL &&
+        (expiry = g_hash_table_lookup (entry->actions, action_id)) != NULL) {
+        if (*expiry > g_get_monotonic_time ()) {
+            stats_counter_inc (STATS_AUTH_CACHE_HIT);
+            return TRUE;
+        }
+        g_hash_table_remove (entry->actions, action_id);
+        if (g_hash_table_size (entry->actions) == 0)
+            g_hash_table_remove (auth_cache, unique_name);
+    }
+    stats_counter_inc (STATS_AUTH_CACHE_MISS);
+    return FALSE;
+}
+
+static gboolean
+auth_cache_action_expired (gpointer key,
+                           gpointer value,
+                           gpointer user_data)
+{
+    return *(gint64 *) value <= *(gint64 *) user_data;
+}
+
+static gboolean
+auth_cache_sender_expired (gpointer key,
+                           gpointer value,
+                           gpointer user_data)
+{
+    struct auth_cache_sender *entry = (struct auth_cache_sender *) value;
+
+    g_hash_table_foreach_remove (entry->actions, auth_cache_action_expired, user_data);
+    return g_hash_table_size (entry->actions) == 0;
+}
+
+static gboolean
+on_auth_cache_sweep (gpointer user_data)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    if (auth_cache != NULL)
+        g_hash_table_foreach_remove (auth_cache, auth_cache_sender_expired, &now);
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+on_sender_get_name_owner (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer user_data)
+{
+    gchar *name = (gchar *) user_data;
+    GVariant *reply;
+    GError *err = NULL;
+
+    if ((reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &err)) != NULL)
+        g_variant_unref (reply);
+    else {
+        /* Gone before the subscription was made: its NameOwnerChanged
+           will never come */
+        g_debug ("'%s' already vanished, dropping its cached authorizations", name);
+        if (auth_cache != NULL)
+            g_hash_table_remove (auth_cache, name);
+        g_error_free (err);
+    }
+    g_free (name);
+}
+
+static void
+auth_cache_insert (const gchar *unique_name,
+                   const gchar *action_id)
+{
+    struct auth_cache_sender *entry;
+    gint64 *expiry;
+
+    if (auth_cache == NULL || unique_name == NULL)
+        return;
+
+    if (get_system_bus () == NULL)
+        return;
+
+    if ((entry = g_hash_table_lookup (auth_cache, unique_name)) == NULL) {
+        entry = g_new0 (struct auth_cache_sender, 1);
+        entry->actions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        entry->subscription_id =
+            g_dbus_connection_signal_subscribe (system_bus,
+                                                "org.freedesktop.DBus",
+                                                "org.freedesktop.DBus",
+                                                "NameOwnerChanged",
+                                                "/org/freedesktop/DBus",
+                                                unique_name,
+                                                G_DBUS_SIGNAL_FLAGS_NONE,
+                                                on_sender_name_owner_changed,
+                                                NULL,
+                                                NULL);
+        g_hash_table_insert (auth_cache, g_strdup (unique_name), entry);
+        g_dbus_connection_call (system_bus,
+                                "org.freedesktop.DBus",
+                                "/org/freedesktop/DBus",
+                                "org.freedesktop.DBus",
+                                "GetNameOwner",
+                                g_variant_new ("(s)", unique_name),
+                                G_VARIANT_TYPE ("(s)"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                on_sender_get_name_owner,
+                                g_strdup (unique_name));
+    }
+    expiry = g_new (gint64, 1);
+    *expiry = g_get_monotonic_time () + (gint64) auth_cache_ttl * G_USEC_PER_SEC;
+    g_hash_table_insert (entry->actions, g_strdup (action_id), expiry);
+}
+
+/**
+ * check_polkit_set_cache_ttl:
+ * @ttl: how long, in seconds, a positive authorization is remembered
+ *
+ * Enable the cache of authorizations if @ttl is not zero, or disable
+ * it. Only the results obtained without user interaction are cached.
+ */
+
+void
+check_polkit_set_cache_ttl (guint ttl)
+{
+    if (auth_cache_sweep_id != 0 && ttl != auth_cache_ttl) {
+        g_source_remove (auth_cache_sweep_id);
+        auth_cache_sweep_id = 0;
+    }
+    auth_cache_ttl = ttl;
+    if (ttl == 0)
+        g_clear_pointer (&auth_cache, g_hash_table_destroy);
+    else if (auth_cache == NULL)
+        auth_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)auth_cache_sender_free);
+    if (ttl != 0 && auth_cache_sweep_id == 0)
+        auth_cache_sweep_id = g_timeout_add_seconds (ttl, on_auth_cache_sweep, NULL);
+}
+
+static void
+cache_authority (PolkitAuthority *authority)
+{
+    if (cached_authority != NULL)
+        return;
+
+    cached_authority = g_object_ref (authority);
+    owner_handler_id = g_signal_connect (cached_authority,
+                                         "notify::owner",
+                                         G_CALLBACK (on_authority_owner_changed),
+                                         NULL);
+    changed_handler_id = g_signal_connect (cached_authority,
+                                           "changed",
+                                           G_CALLBACK (on_authority_changed),
+                                           NULL);
+}
+
+static void
+check_polkit_init_cb (GObject *source_object,
+                      GAsyncResult *res,
+                      gpointer user_data)
+{
+    PolkitAuthority *authority;
+    GError *err = NULL;
+
+    if ((authority = polkit_authority_get_finish (res, &err)) == NULL) {
+        /* Not fatal: it will be sought again by the first check */
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            g_debug ("Could not get polkit authority: %s", err->message);
+        g_clear_error (&err);
+        return;
+    }
+    cache_authority (authority);
+    g_object_unref (authority);
+}
+
+/**
+ * check_polkit_init:
+ *
+ * Start seeking the polkit authority, so that it is available when
+ * the first authorization is requested. Does not block.
+ */
+
+void
+check_polkit_init (void)
+{
+    if (cached_authority != NULL || init_cancellable != NULL)
+        return;
+
+    init_cancellable = g_cancellable_new ();
+    polkit_authority_get_async (init_cancellable, check_polkit_init_cb, NULL);
+}
+
+/**
+ * check_polkit_destroy:
+ *
+ * Release the polkit authority
+ */
+
+void
+check_polkit_destroy (void)
+{
+    if (init_cancellable != NULL) {
+        g_cancellable_cancel (init_cancellable);
+        g_clear_object (&init_cancellable);
+    }
+    if (cached_authority != NULL) {
+        g_signal_handler_disconnect (cached_authority, owner_handler_id);
+        g_signal_handler_disconnect (cached_authority, changed_handler_id);
+        owner_handler_id = changed_handler_id = 0;
+        g_clear_object (&cached_authority);
+    }
+    if (auth_cache_sweep_id != 0) {
+        g_source_remove (auth_cache_sweep_id);
+        auth_cache_sweep_id = 0;
+    }
+    g_clear_pointer (&auth_cache, g_hash_table_destroy);
+    g_clear_object (&system_bus);
+}
+
 /*
   We are called through the function "check_polkit_async", which
-  just packs the needed data, and call the get_authority function. This
-  function is passed a callback, which will get the result and the data,
+  just packs the needed data, and, if the authority is known, calls the
+  polkit_check function. Otherwise, it calls the get_authority function,
+  which is passed a callback, which will get the result and the data,
   then call the polkit_check function. This function is itself passed
   a callback, which has two things to do:
   - get the result from the check (using polkit_check_finish)
@@ -115,44 +614,69 @@ check_polkit_authorization_cb (GObject *source_object,
                                GAsyncResult *res,
                                gpointer _data);
 
+static void
+check_polkit_authorization (struct check_polkit_data *data);
+
 /**
  * check_polkit_async:
- * @unique_name: the connection who invoked the method for which an
- * authorization is sought
- * @action_id: what action (for us, either set-keyboard or set-locale)
+ * @invocation: the method call for which an authorization is sought
+ * @action_id: what action (for us, set-keyboard, set-locale or set-all)
  * @user_interaction: whether the user is allowed to interact for
  * getting the authorization
  * @callback: function to call when done
  * @user_data: a struct passed to the callback
  *
- * Check that the user associated with @unique_name is authorized
+ * Check that the caller of @invocation is authorized
  * to perform @action_id. When the result is known, calls @callback
  * passing @user_data
  */
 void
-check_polkit_async (const gchar *unique_name,
+check_polkit_async (GDBusMethodInvocation *invocation,
                     const gchar *action_id,
                     const gboolean user_interaction,
                     GAsyncReadyCallback callback,
                     gpointer user_data)
 {
     struct check_polkit_data *data;
+    const gchar *unique_name = g_dbus_method_invocation_get_sender (invocation);
 
     data = g_new0 (struct check_polkit_data, 1);
-    data->unique_name = unique_name;
-    data->action_id = action_id;
+    data->start = g_get_monotonic_time ();
+    data->request_id = PROBE_REQUEST_ID;
+    data->unique_name = g_strdup (unique_name);
+    if (unique_name == NULL)
+        data->peer = g_object_ref (g_dbus_method_invocation_get_connection (invocation));
+    data->action_id = g_strdup (action_id);
     data->user_interaction = user_interaction;
     data->callback = callback;
     data->user_data = user_data;
+    PROBE2 (polkit__start, data->request_id, action_id);
+
+    if (auth_cache_lookup (unique_name, action_id)) {
+        g_debug ("Authorizing '%s' for '%s': cached", unique_name, action_id);
+        check_polkit_return (data, NULL);
+        check_polkit_data_free (data);
+        return;
+    }
 
-/* Note: the first parameter is a GCancellable. Passing NULL means the
-         action cannot be cancelled (Hmmm, am I sure?). */
-    polkit_authority_get_async (NULL, check_polkit_authority_cb, data);
+    data->cancellable = g_cancellable_new ();
+    check_polkit_watch (data);
+
+    if (cached_authority != NULL) {
+        data->authority = g_object_ref (cached_authority);
+        check_polkit_authorization (data);
+        return;
+    }
+
+/* Note: the first parameter is a GCancellable. Cancelling it makes the
+         callback be called with G_IO_ERROR_CANCELLED. */
+    polkit_authority_get_async (data->cancellable, check_polkit_authority_cb, data);
 }
 
 /*
-  Now the first callback: The authority_get action is complete, and we
-  need to test it, and use it to get the authorization if available
+  Now the first callback, only used when the authority was not known: the
+  authority_get action is complete, and we need to test it, and use it to
+  get the authorization if available
 */
 
 static void
@@ -166,17 +690,67 @@ check_polkit_authority_cb (GObject *source_object,
     data = (struct check_polkit_data *) _data;
     if ((data->authority = polkit_authority_get_finish (res, &err)) == NULL) {
 // I'm not sure about the second NULL...
-        g_task_report_error (NULL, data->callback, data->user_data, NULL, err);
+        check_polkit_return (data, err);
+        check_polkit_data_free (data);
+        return;
+    }
+    cache_authority (data->authority);
+    if (data->completed) {
+        /* Aborted meanwhile */
         check_polkit_data_free (data);
         return;
     }
-    if (data->unique_name == NULL || data->action_id == NULL || 
-        (data->subject = polkit_system_bus_name_new (data->unique_name)) == NULL) {
-        g_task_report_new_error (NULL, data->callback, data->user_data, NULL, POLKIT_ERROR, POLKIT_ERROR_FAILED, "Authorizing for '%s': failed sanity check", data->action_id);
+    check_polkit_authorization (data);
+}
+
+static PolkitSubject *
+check_polkit_subject_new (const struct check_polkit_data *data)
+{
+#if defined (HAVE_POLKIT_UNIX_PROCESS_NEW_PIDFD) && HAVE_DECL_SO_PEERPIDFD
+    GCredentials *credentials;
+    GIOStream *stream;
+    PolkitSubject *subject;
+    socklen_t len;
+    gint pidfd;
+    uid_t uid;
+#endif
+
+    if (data->unique_name != NULL)
+        return polkit_system_bus_name_new (data->unique_name);
+#if defined (HAVE_POLKIT_UNIX_PROCESS_NEW_PIDFD) && HAVE_DECL_SO_PEERPIDFD
+    if (data->peer == NULL ||
+        (credentials = g_dbus_connection_get_peer_credentials (data->peer)) == NULL ||
+        (uid = g_credentials_get_unix_user (credentials, NULL)) == (uid_t) -1)
+        return NULL;
+    stream = g_dbus_connection_get_stream (data->peer);
+    if (!G_IS_SOCKET_CONNECTION (stream))
+        return NULL;
+    len = sizeof (pidfd);
+    if (getsockopt (g_socket_get_fd (g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream))),
+                    SOL_SOCKET, SO_PEERPIDFD, &pidfd, &len) < 0)
+        return NULL;
+    /* polkit keeps its own copy of the descriptor */
+    subject = polkit_unix_process_new_pidfd (pidfd, uid, NULL);
+    close (pidfd);
+    return subject;
+#else
+    /* The process could only be given by its PID, which may be reused
+       by another process before polkit looks it up */
+    g_debug ("Authorizing peer for '%s': no pidfd support, denied", data->action_id);
+    return NULL;
+#endif
+}
+
+static void
+check_polkit_authorization (struct check_polkit_data *data)
+{
+    if (data->action_id == NULL ||
+        (data->subject = check_polkit_subject_new (data)) == NULL) {
+        check_polkit_return (data, g_error_new (POLKIT_ERROR, POLKIT_ERROR_FAILED, "Authorizing for '%s': failed sanity check", data->action_id));
         check_polkit_data_free (data);
         return;
     }
-    polkit_authority_check_authorization (data->authority, data->subject, data->action_id, NULL, (PolkitCheckAuthorizationFlags) data->user_interaction, NULL, check_polkit_authorization_cb, data);
+    polkit_authority_check_authorization (data->authority, data->subject, data->action_id, NULL, (PolkitCheckAuthorizationFlags) data->user_interaction, data->cancellable, check_polkit_authorization_cb, data);
 }
 
 /*
@@ -191,24 +765,29 @@ check_polkit_authorization_cb (GObject *source_object,
 {
     struct check_polkit_data *data;
     PolkitAuthorizationResult *result;
-    GTask *task;
     GError *err = NULL;
 
     data = (struct check_polkit_data *) _data;
     if ((result = polkit_authority_check_authorization_finish (data->authority, res, &err)) == NULL) {
-        g_task_report_error (NULL, data->callback, data->user_data, NULL, err);
+        check_polkit_return (data, err);
         goto out;
     }
+    /* Aborted: the caller does not want the result anymore */
+    if (data->completed)
+        goto out;
  
     if (!polkit_authorization_result_get_is_authorized (result)) {
-        g_task_report_new_error (NULL, data->callback, data->user_data, NULL, POLKIT_ERROR, POLKIT_ERROR_NOT_AUTHORIZED, "Authorizing for '%s': not authorized", data->action_id);
+        check_polkit_return (data, g_error_new (POLKIT_ERROR, POLKIT_ERROR_NOT_AUTHORIZED, "Authorizing for '%s': not authorized", data->action_id));
         goto out;
     }
-    task = g_task_new (NULL, NULL, data->callback, data->user_data);
-    g_task_return_boolean (task, TRUE);
-//    g_simple_async_result_complete_in_idle (simple); Apparently this step
-//    not needed with GTask
-    g_object_unref (task);
+    /* Never remember what may have needed a password, or was granted
+       for a limited time by polkit itself */
+    if (!data->user_interaction &&
+        !polkit_authorization_result_get_retains_authorization (result) &&
+        polkit_authorization_result_get_temporary_authorization_id (result) == NULL)
+        auth_cache_insert (data->unique_name, data->action_id);
+
+    check_polkit_return (data, NULL);
 
   out:
     check_polkit_data_free (data);
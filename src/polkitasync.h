@@ -41,7 +41,19 @@
  */
 
 void
-check_polkit_async (const gchar *unique_name,
+check_polkit_init (void);
+
+void
+check_polkit_destroy (void);
+
+void
+check_polkit_set_cache_ttl (guint ttl);
+
+void
+check_polkit_set_timeout (guint timeout);
+
+void
+check_polkit_async (GDBusMethodInvocation *invocation,
                     const gchar *action_id,
                     const gboolean user_interaction,
                     GAsyncReadyCallback callback,
@@ -0,0 +1,119 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: probes
+ * @short_description: Static tracing probes
+ * @title: Probes
+ * @include: probes.h
+ *
+ * USDT probes, for SystemTap or bpftrace, with the "blocaled" provider.
+ * They are only compiled in when configure finds sys/sdt.h, and are
+ * then a nop instruction each until a tracer attaches to them, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/libexec/blocaled:polkit__done { ... }'
+ *
+ * The first argument of every probe is the ID of the request being
+ * served, or 0 outside of a request (startup, reload of a changed
+ * file). The ID of the current request is kept per thread, and set by
+ * #PROBE_REQUEST_SCOPE for the rest of a block. The probes are:
+ *
+ * - request__start (id, method name)
+ * - request__done (id, failed, microseconds)
+ * - polkit__start (id, action id)
+ * - polkit__done (id, action id, authorized)
+ * - shell_parse__start (id, file name, bytes)
+ * - shell_parse__done (id, file name, success)
+ * - xorg_parse__start (id, file name, bytes)
+ * - xorg_parse__done (id, file name, success)
+ * - shell_save__start (id, file name)
+ * - shell_save__done (id, file name, success)
+ * - xorg_save__start (id, file name)
+ * - xorg_save__done (id, file name, success)
+ * - file_stage (id, file name, bytes)
+ * - commit__start (id, number of files)
+ * - commit__done (id, success)
+ * - kbd_model_map_lookup__start (id, console keymap or X11 layout)
+ * - kbd_model_map_lookup__done (id, found)
+ */
+
+/* config.h is force-included by the Makefiles: this only catches a
+   build which does not, where HAVE_SYS_SDT_H would be silently unset */
+#ifndef PACKAGE_NAME
+#error "config.h must be included before probes.h"
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+/* Defined in localed.c */
+extern __thread guint64 probe_request_id;
+
+#define PROBE_REQUEST_ID probe_request_id
+
+#define PROBE1(name, id) DTRACE_PROBE1 (blocaled, name, id)
+#define PROBE2(name, id, a) DTRACE_PROBE2 (blocaled, name, id, a)
+#define PROBE3(name, id, a, b) DTRACE_PROBE3 (blocaled, name, id, a, b)
+#define PROBE4(name, id, a, b, c) DTRACE_PROBE4 (blocaled, name, id, a, b, c)
+
+static inline guint64
+probe_request_enter (guint64 id)
+{
+    guint64 previous = probe_request_id;
+
+    probe_request_id = id;
+    return previous;
+}
+
+static inline void
+probe_request_leave (guint64 *previous)
+{
+    probe_request_id = *previous;
+}
+
+/* The previous ID is restored when the block is left */
+#define PROBE_REQUEST_SCOPE(id) \
+    guint64 probe_request_previous __attribute__ ((cleanup (probe_request_leave))) = probe_request_enter (id)
+
+#else
+
+#define PROBE_REQUEST_ID 0
+
+#define PROBE1(name, id) G_STMT_START { } G_STMT_END
+#define PROBE2(name, id, a) G_STMT_START { } G_STMT_END
+#define PROBE3(name, id, a, b) G_STMT_START { } G_STMT_END
+#define PROBE4(name, id, a, b, c) G_STMT_START { } G_STMT_END
+
+#define PROBE_REQUEST_SCOPE(id) G_STMT_START { } G_STMT_END
+
+#endif
+
+#endif
@@ -36,7 +36,11 @@ DEBUG end */
 #include <glib.h>
 #include <gio/gio.h>
 
+#include "filetransaction.h"
+#include "probes.h"
 #include "shellparser.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "config.h"
 
@@ -144,13 +148,15 @@ shell_parser_new (GFile *file,
                   GError **error)
 {
     gchar *filebuf = NULL;
+    gsize length = 0;
     GError *local_err = NULL;
     ShellParser *ret = NULL;
+    gint64 start;
 
     if (file == NULL)
         return NULL;
 
-    if (!g_file_load_contents (file, NULL, &filebuf, NULL, NULL, &local_err)) {
+    if (!g_file_load_contents (file, NULL, &filebuf, &length, NULL, &local_err)) {
         if (local_err != NULL) {
             /* Inability to parse or open is a failure; file not existing at all is *not* a failure */
             if (local_err->code == G_IO_ERROR_NOT_FOUND) {
@@ -169,7 +175,11 @@ shell_parser_new (GFile *file,
         }
         return NULL;
     }
+    PROBE3 (shell_parse__start, PROBE_REQUEST_ID, g_file_peek_path (file), length);
+    start = g_get_monotonic_time ();
     ret = shell_parser_new_from_string (file, filebuf, error);
+    stats_stage_add (STATS_STAGE_PARSE, start);
+    PROBE3 (shell_parse__done, PROBE_REQUEST_ID, g_file_peek_path (file), ret != NULL);
     g_free (filebuf);
     return ret;
 }
@@ -217,7 +227,7 @@ shell_parser_new_from_string (GFile *file,
     gboolean want_separator = FALSE; /* Do we expect the next entry to be a separator or comment? */
     s = filebuf;
     while (*s != 0) {
-        g_debug ("Scanning string: ``%s''", s);
+        TRACE ("Scanning line: ``%.*s''", (int) strcspn (s, "\n"), s);
         gboolean matched = FALSE;
         GMatchInfo *match_info = NULL;
         struct ShellEntry *entry = NULL;
@@ -229,7 +239,7 @@ shell_parser_new_from_string (GFile *file,
             entry->string = g_match_info_fetch (match_info, 0);
             ret->entry_list = g_list_prepend (ret->entry_list, entry);
             s += strlen (entry->string);
-            g_debug ("Scanned comment: ``%s''", entry->string);
+            TRACE ("Scanned comment: ``%s''", entry->string);
             _g_match_info_clear (&match_info);
             want_separator = FALSE;
             continue;
@@ -243,7 +253,7 @@ shell_parser_new_from_string (GFile *file,
             entry->string = g_match_info_fetch (match_info, 0);
             ret->entry_list = g_list_prepend (ret->entry_list, entry);
             s += strlen (entry->string);
-            g_debug ("Scanned separator: ``%s''", entry->string);
+            TRACE ("Scanned separator: ``%s''", entry->string);
             _g_match_info_clear (&match_info);
             want_separator = FALSE;
             continue;
@@ -257,7 +267,7 @@ shell_parser_new_from_string (GFile *file,
             entry->string = g_match_info_fetch (match_info, 0);
             ret->entry_list = g_list_prepend (ret->entry_list, entry);
             s += strlen (entry->string);
-            g_debug ("Scanned indent: ``%s''", entry->string);
+            TRACE ("Scanned indent: ``%s''", entry->string);
             _g_match_info_clear (&match_info);
             continue;
         }
@@ -275,37 +285,31 @@ shell_parser_new_from_string (GFile *file,
             entry->string = g_match_info_fetch (match_info, 0);
             entry->variable = g_match_info_fetch (match_info, 1);
             s += strlen (entry->string);
-            g_debug ("Scanned variable: ``%s''", entry->string);
+            TRACE ("Scanned variable: ``%s''", entry->string);
             _g_match_info_clear (&match_info);
             want_separator = TRUE;
 
             while (*s != 0) {
-                g_debug ("Scanning string for values: ``%s''", s);
+                TRACE ("Scanning line for values: ``%.*s''", (int) strcspn (s, "\n"), s);
                 gboolean matched2 = FALSE;
 
                 matched2 = g_regex_match (single_quoted_regex, s, 0, &match_info);
                 if (matched2) {
-                    temp1 = g_match_info_fetch (match_info, 0);
-                    g_debug ("Found single quoted: ``%s''", temp1);
-                    g_free (temp1);
+                    TRACE ("Found single quoted value");
                     goto append_value;
                 }
                 _g_match_info_clear (&match_info);
 
                 matched2 = g_regex_match (double_quoted_regex, s, 0, &match_info);
                 if (matched2) {
-                    temp1 = g_match_info_fetch (match_info, 0);
-                    g_debug ("Found double quoted: ``%s''", temp1);
-                    g_free (temp1);
+                    TRACE ("Found double quoted value");
                     goto append_value;
                 }
                 _g_match_info_clear (&match_info);
 
                 matched2 = g_regex_match (unquoted_regex, s, 0, &match_info);
                 if (matched2) {
-                    temp1 = g_match_info_fetch (match_info, 0);
-                    g_debug ("Found unquoted: ``%s''", temp1);
-                    g_free (temp1);
+                    TRACE ("Found unquoted value");
                     goto append_value;
                 }
                 _g_match_info_clear (&match_info);
@@ -316,13 +320,13 @@ shell_parser_new_from_string (GFile *file,
                 if (raw_value == NULL) {
                     raw_value = g_match_info_fetch (match_info, 0);
                     s += strlen (raw_value);
-                    g_debug ("Scanned value: ``%s''", raw_value);
+                    TRACE ("Scanned value: ``%s''", raw_value);
                 } else {
                     temp1 = raw_value;
                     temp2 = g_match_info_fetch (match_info, 0);
                     raw_value = g_strconcat (temp1, temp2, NULL);
                     s += strlen (temp2);
-                    g_debug ("Scanned value: ``%s''", temp2);
+                    TRACE ("Scanned value: ``%s''", temp2);
                     g_free (temp1);
                     g_free (temp2);
                 }
@@ -331,7 +335,7 @@ shell_parser_new_from_string (GFile *file,
 
             if (raw_value != NULL) {
                 entry->unquoted_value = g_shell_unquote (raw_value, &local_err);
-                g_debug  ("Unquoted value: ``%s''", entry->unquoted_value);
+                TRACE ("Unquoted value: ``%s''", entry->unquoted_value);
                 temp1 = entry->string;
                 temp2 = raw_value;
                 entry->string = g_strconcat (temp1, temp2, NULL);
@@ -611,6 +615,44 @@ DEBUG end */
 DEBUG end */
 }
 
+/**
+ * shell_parser_stage:
+ * @parser: parser to write back to its file
+ * @trans: the transaction the file is written in
+ * @error: set in case of error
+ *
+ * Stages the content of the parser for replacing its member file when
+ * @trans is committed
+ *
+ * Returns: %FALSE in case of error, %TRUE if the operation succeeded.
+ */
+
+gboolean
+shell_parser_stage (ShellParser *parser,
+                    FileTransaction *trans,
+                    GError **error)
+{
+    gboolean ret;
+    GList *curr = NULL;
+    GString *contents = NULL;
+    gint64 start = g_get_monotonic_time ();
+
+    g_assert (parser != NULL && parser->file != NULL && parser->filename != NULL);
+
+    contents = g_string_new (NULL);
+    for (curr = parser->entry_list; curr != NULL; curr = curr->next) {
+        struct ShellEntry *entry;
+
+        entry = (struct ShellEntry *)(curr->data);
+        g_string_append (contents, entry->string);
+    }
+    stats_stage_add (STATS_STAGE_SERIALIZE, start);
+
+    ret = file_transaction_stage (trans, parser->file, contents->str, contents->len, error);
+    g_string_free (contents, TRUE);
+    return ret;
+}
+
 /**
  * shell_parser_save:
  * @parser: parser to write back to its file
@@ -626,50 +668,93 @@ shell_parser_save (ShellParser *parser,
                    GError **error)
 {
     gboolean ret = FALSE;
-    GList *curr = NULL;
-    GFileOutputStream *os = NULL;
-    gchar *dirname = NULL;
+    FileTransaction *trans;
 
     g_assert (parser != NULL && parser->file != NULL && parser->filename != NULL);
-    dirname = g_path_get_dirname (parser->filename);
-    if(g_mkdir_with_parents (dirname, 0755) == -1) {
-        g_set_error (error,
-                     G_FILE_ERROR,
-                     g_file_error_from_errno (errno),
-                     "Could not create directory '%s': %s",
-                     dirname,
-                     strerror (errno)
-                    );
-        goto out;
-        }
 
-    if ((os = g_file_replace (parser->file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error)) == NULL) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        goto out;
-    }
+    PROBE2 (shell_save__start, PROBE_REQUEST_ID, parser->filename);
+    trans = file_transaction_new ();
+    if (shell_parser_stage (parser, trans, error) &&
+        file_transaction_commit (trans, error))
+        ret = TRUE;
+    file_transaction_free (trans);
+    PROBE3 (shell_save__done, PROBE_REQUEST_ID, parser->filename, ret);
+    return ret;
+}
 
-    for (curr = parser->entry_list; curr != NULL; curr = curr->next) {
-        struct ShellEntry *entry;
-        gsize written;
+static gboolean
+shell_parser_set_variables_valist (ShellParser *parser,
+                                   GError **error,
+                                   const gchar *first_var_name,
+                                   const gchar *first_alt_var_name,
+                                   const gchar *first_value,
+                                   va_list ap)
+{
+    const gchar *var_name, *alt_var_name, *value;
 
-        entry = (struct ShellEntry *)(curr->data);
-        if (!g_output_stream_write_all (G_OUTPUT_STREAM (os), entry->string, strlen (entry->string), &written, NULL, error)) {
-            g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-            goto out;
+    var_name = first_var_name;
+    alt_var_name = first_alt_var_name;
+    value = first_value;
+    do {
+      if (value != NULL && *value != 0) {
+        if (alt_var_name == NULL) {
+            if (!shell_parser_set_variable (parser, var_name, value, TRUE)) {
+                g_propagate_error (error,
+                        g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                    "Unable to set %s in '%s'", var_name, parser->filename));
+                return FALSE;
+            }
+        } else {
+            if (!shell_parser_set_variable (parser, var_name, value, FALSE) &&
+                !shell_parser_set_variable (parser, alt_var_name, value, FALSE) &&
+                !shell_parser_set_variable (parser, var_name, value, TRUE)) {
+                    g_propagate_error (error,
+                            g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                        "Unable to set %s or %s in '%s'", var_name, alt_var_name, parser->filename));
+                    return FALSE;
+            }
         }
-    }
-    
-    if (!g_output_stream_close (G_OUTPUT_STREAM (os), NULL, error)) {
-        g_prefix_error (error, "Unable to save '%s': ", parser->filename);
-        g_output_stream_close (G_OUTPUT_STREAM (os), NULL, NULL);
-        goto out;
-    }
-    ret = TRUE;
+      }
+    } while ((var_name = va_arg (ap, const gchar*)) != NULL ?
+                 alt_var_name = va_arg (ap, const gchar*), value = va_arg (ap, const gchar*), 1 : 0);
 
-  out:
-    g_free (dirname);
-    if (os)
-        g_object_unref (os);
+    return TRUE;
+}
+
+/**
+ * shell_parser_set_variables:
+ * @parser: (not nullable): the parser on which to act
+ * @error: set if an error occurs
+ * @first_var_name: variable to be set, either if found in @parser, or if
+ * not found and @first_alt_var_name is not found either
+ * @first_alt_var_name: (nullable): variable to be set if found,
+ * and @first_var_name is not
+ * @first_value: the value to be stored in variable
+ * @...: a series of triplets var_name, alt_var_name, value, terminated
+ * by %NULL
+ *
+ * Store the values into the associated variables, creating them if
+ * necessary. Empty or %NULL values are skipped.
+ *
+ * Returns: %FALSE in case of error, %TRUE if the operation succeeded
+ */
+
+gboolean
+shell_parser_set_variables (ShellParser *parser,
+                            GError **error,
+                            const gchar *first_var_name,
+                            const gchar *first_alt_var_name,
+                            const gchar *first_value,
+                            ...)
+{
+    va_list ap;
+    gboolean ret;
+
+    g_assert (parser != NULL);
+
+    va_start (ap, first_value);
+    ret = shell_parser_set_variables_valist (parser, error, first_var_name, first_alt_var_name, first_value, ap);
+    va_end (ap);
     return ret;
 }
 
@@ -701,37 +786,13 @@ shell_parser_set_and_save (GFile *file,
     va_list ap;
     ShellParser *parser;
     gboolean ret = FALSE;
-    const gchar *var_name, *alt_var_name, *value;
 
     va_start (ap, first_value);
     if ((parser = shell_parser_new (file, error)) == NULL)
         goto out;
 
-    var_name = first_var_name;
-    alt_var_name = first_alt_var_name;
-    value = first_value;
-    do {
-      if (value != NULL && *value != 0) {
-        if (alt_var_name == NULL) {
-            if (!shell_parser_set_variable (parser, var_name, value, TRUE)) {
-                g_propagate_error (error,
-                        g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                                    "Unable to set %s in '%s'", var_name, parser->filename));
-                goto out;
-            }
-        } else {
-            if (!shell_parser_set_variable (parser, var_name, value, FALSE) &&
-                !shell_parser_set_variable (parser, alt_var_name, value, FALSE) &&
-                !shell_parser_set_variable (parser, var_name, value, TRUE)) {
-                    g_propagate_error (error,
-                            g_error_new (G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                                        "Unable to set %s or %s in '%s'", var_name, alt_var_name, parser->filename));
-                    goto out;
-            }
-        }
-      }
-    } while ((var_name = va_arg (ap, const gchar*)) != NULL ?
-                 alt_var_name = va_arg (ap, const gchar*), value = va_arg (ap, const gchar*), 1 : 0);
+    if (!shell_parser_set_variables_valist (parser, error, first_var_name, first_alt_var_name, first_value, ap))
+        goto out;
 
     if (!shell_parser_save (parser, error))
         goto out;
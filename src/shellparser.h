@@ -30,6 +30,8 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#include "filetransaction.h"
+
 /**
  * SECTION: shellparser
  * @short_description: A variable=value shell parser
@@ -100,6 +102,19 @@ void
 shell_parser_clear_variable (ShellParser *parser,
                              const gchar *variable);
 
+gboolean
+shell_parser_set_variables (ShellParser *parser,
+                            GError **error,
+                            const gchar *first_var_name,
+                            const gchar *first_alt_var_name,
+                            const gchar *first_value,
+                            ...);
+
+gboolean
+shell_parser_stage (ShellParser *parser,
+                    FileTransaction *trans,
+                    GError **error);
+
 gboolean
 shell_parser_save (ShellParser *parser,
                    GError **error);
@@ -0,0 +1,208 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "blocaled-shm.h"
+#include "stateshm.h"
+
+#include "config.h"
+
+static struct blocaled_shm *shm = NULL;
+
+static struct blocaled_shm *
+state_shm_map (int fd)
+{
+    struct blocaled_shm *ret;
+
+    ret = mmap (NULL, sizeof (struct blocaled_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+/*
+  The file left by a previous instance is reused, so that the readers
+  which mapped it keep following the settings, and the generation goes
+  on, even if that instance died in the middle of a write. Otherwise, a
+  new file is initialized aside, then renamed, so that no reader sees it
+  half initialized.
+*/
+
+static struct blocaled_shm *
+state_shm_reuse (const gchar *path)
+{
+    struct blocaled_shm *ret = NULL;
+    struct stat st;
+    int fd;
+
+    if ((fd = g_open (path, O_RDWR | O_CLOEXEC, 0)) < 0)
+        return NULL;
+    if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) &&
+        st.st_size == sizeof (struct blocaled_shm) &&
+        (ret = state_shm_map (fd)) != NULL &&
+        (ret->magic != BLOCALED_SHM_MAGIC || ret->version != BLOCALED_SHM_VERSION)) {
+        /* Another format */
+        munmap (ret, sizeof (struct blocaled_shm));
+        ret = NULL;
+    }
+    if (ret != NULL && (ret->sequence & 1)) {
+        /* The previous instance died while writing: as the only writer,
+           complete the write, with no text until the settings are
+           published again, so that the readers stop waiting */
+        ret->length = 0;
+        ret->generation++;
+        __atomic_store_n (&ret->sequence, ret->sequence + 1, __ATOMIC_RELEASE);
+    }
+    close (fd);
+    return ret;
+}
+
+/**
+ * state_shm_open:
+ * @path: the state file
+ * @error: return location for an error
+ *
+ * Create the state file, or reuse the one at @path, readable by all.
+ *
+ * Returns: %TRUE on success
+ */
+
+gboolean
+state_shm_open (const gchar *path,
+                GError **error)
+{
+    gchar *dir = NULL, *tmpname = NULL;
+    struct blocaled_shm *new_shm = NULL;
+    gboolean ret = FALSE;
+    int fd = -1;
+
+    g_return_val_if_fail (shm == NULL, FALSE);
+
+    if ((shm = state_shm_reuse (path)) != NULL) {
+        g_debug ("Reusing %s, at generation %" G_GUINT64_FORMAT, path, shm->generation);
+        return TRUE;
+    }
+
+    dir = g_path_get_dirname (path);
+    if (g_mkdir_with_parents (dir, 0755) < 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Failed to create '%s': %s", dir, g_strerror (errno));
+        goto out;
+    }
+    tmpname = g_strdup_printf ("%s.XXXXXX", path);
+    if ((fd = g_mkstemp_full (tmpname, O_RDWR | O_CLOEXEC, 0644)) < 0 ||
+        fchmod (fd, 0644) < 0 ||
+        ftruncate (fd, sizeof (struct blocaled_shm)) < 0 ||
+        (new_shm = state_shm_map (fd)) == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Failed to create '%s': %s", tmpname, g_strerror (errno));
+        goto out;
+    }
+    new_shm->magic = BLOCALED_SHM_MAGIC;
+    new_shm->version = BLOCALED_SHM_VERSION;
+    new_shm->size = sizeof (struct blocaled_shm);
+    if (g_rename (tmpname, path) < 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Failed to rename '%s' to '%s': %s", tmpname, path, g_strerror (errno));
+        goto out;
+    }
+    shm = new_shm;
+    new_shm = NULL;
+    ret = TRUE;
+
+  out:
+    if (new_shm != NULL)
+        munmap (new_shm, sizeof (struct blocaled_shm));
+    if (fd >= 0) {
+        close (fd);
+        if (!ret)
+            g_unlink (tmpname);
+    }
+    g_free (dir);
+    g_free (tmpname);
+    return ret;
+}
+
+/**
+ * state_shm_publish:
+ * @text: the settings, as described in blocaled-shm.h
+ *
+ * Replace the settings in the state file, and increment the generation,
+ * unless they are unchanged. Does nothing if the file is not open.
+ */
+
+void
+state_shm_publish (const gchar *text)
+{
+    gsize length;
+    guint64 sequence;
+
+    if (shm == NULL)
+        return;
+
+    length = strlen (text);
+    if (length > BLOCALED_SHM_DATA_SIZE) {
+        /* Keep whole lines */
+        const gchar *end = g_strrstr_len (text, BLOCALED_SHM_DATA_SIZE, "\n");
+
+        g_warning ("The settings do not fit in the state file, truncating them");
+        length = end != NULL ? (gsize) (end - text) + 1 : 0;
+    }
+    if (length == shm->length && !memcmp (shm->data, text, length))
+        return;
+
+    /* Only this thread writes, so plain reads of sequence are fine */
+    sequence = shm->sequence;
+    __atomic_store_n (&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (shm->data, text, length);
+    __atomic_store_n (&shm->length, length, __ATOMIC_RELAXED);
+    __atomic_store_n (&shm->generation, shm->generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n (&shm->sequence, sequence + 2, __ATOMIC_RELEASE);
+    g_debug ("State file at generation %" G_GUINT64_FORMAT, shm->generation);
+}
+
+/**
+ * state_shm_close:
+ *
+ * Unmap the state file. The file is left in place, with the last
+ * settings, for the readers.
+ */
+
+void
+state_shm_close (void)
+{
+    if (shm == NULL)
+        return;
+    munmap (shm, sizeof (struct blocaled_shm));
+    shm = NULL;
+}
@@ -0,0 +1,478 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <glib.h>
+
+#include "stats.h"
+
+#include "config.h"
+
+/* How often the Prometheus textfile is rewritten, in seconds */
+#define STATS_TEXTFILE_INTERVAL 15
+
+struct stats_histogram {
+    guint64 count;     /* the sum of the buckets, set by histogram_read */
+    guint64 sum;       /* microseconds */
+    guint64 buckets[STATS_N_BUCKETS];
+};
+
+struct stats_gauge {
+    gint64 value;
+    gint64 max;
+};
+
+static guint64 counters[STATS_N_COUNTERS];
+static struct stats_gauge gauges[STATS_N_GAUGES];
+static guint64 method_errors[STATS_N_METHODS];
+static struct stats_histogram method_histograms[STATS_N_METHODS];
+static struct stats_histogram stage_histograms[STATS_N_STAGES];
+
+static gchar *textfile = NULL;
+static guint textfile_id = 0;
+
+/* Keep in the same order as StatsCounter */
+static const gchar *counter_names[STATS_N_COUNTERS] = {
+    "deferred_sync_ok",
+    "deferred_sync_failed",
+    "auth_cache_hit",
+    "auth_cache_miss",
+    "rejected_invalid_args",
+    "noop_requests",
+    "prepared_reused",
+    "prepared_stale",
+};
+
+/* Keep in the same order as StatsGauge */
+static const gchar *gauge_names[STATS_N_GAUGES] = {
+    "requests_in_flight",
+    "deferred_syncs",
+};
+
+/* Keep in the same order as StatsMethod */
+static const gchar *method_names[STATS_N_METHODS] = {
+    "SetLocale",
+    "SetVConsoleKeyboard",
+    "SetX11Keyboard",
+    "SetLocaleVariables",
+    "SetAll",
+    "ListLocales",
+    "ListVConsoleKeymaps",
+    "ListX11Layouts",
+};
+
+/* Keep in the same order as StatsStage */
+static const gchar *stage_names[STATS_N_STAGES] = {
+    "validation",
+    "polkit",
+    "map_lookup",
+    "parse",
+    "serialize",
+    "write",
+    "fsync",
+};
+
+/**
+ * stats_counter_inc:
+ * @counter: the counter to increment
+ *
+ * Atomically add one to @counter. May be called from any thread.
+ */
+
+void
+stats_counter_inc (StatsCounter counter)
+{
+    g_assert (counter < STATS_N_COUNTERS);
+    __atomic_add_fetch (&counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_counter_get:
+ * @counter: the counter to read
+ *
+ * Returns: the current value of @counter
+ */
+
+guint64
+stats_counter_get (StatsCounter counter)
+{
+    g_assert (counter < STATS_N_COUNTERS);
+    return __atomic_load_n (&counters[counter], __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_counter_name:
+ * @counter: a counter
+ *
+ * Returns: the name of @counter, as used in the logs
+ */
+
+const gchar *
+stats_counter_name (StatsCounter counter)
+{
+    g_assert (counter < STATS_N_COUNTERS);
+    return counter_names[counter];
+}
+
+/**
+ * stats_gauge_add:
+ * @gauge: the gauge to change
+ * @delta: what to add to it, negative to decrease it
+ *
+ * Atomically change @gauge, and its maximum if it is exceeded. May be
+ * called from any thread.
+ */
+
+void
+stats_gauge_add (StatsGauge gauge,
+                 gint64 delta)
+{
+    gint64 value, max;
+
+    g_assert (gauge < STATS_N_GAUGES);
+    value = __atomic_add_fetch (&gauges[gauge].value, delta, __ATOMIC_RELAXED);
+    max = __atomic_load_n (&gauges[gauge].max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n (&gauges[gauge].max, &max, value, TRUE,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * stats_method_from_name:
+ * @name: a D-Bus method name
+ *
+ * Returns: the method named @name, or %STATS_N_METHODS if it is not
+ * followed
+ */
+
+StatsMethod
+stats_method_from_name (const gchar *name)
+{
+    StatsMethod method;
+
+    for (method = 0; method < STATS_N_METHODS; method++)
+        if (g_strcmp0 (name, method_names[method]) == 0)
+            break;
+    return method;
+}
+
+static void
+histogram_add (struct stats_histogram *histogram,
+               gint64 start)
+{
+    gint64 duration = g_get_monotonic_time () - start;
+    guint bucket;
+
+    if (duration < 0)
+        duration = 0;
+    /* Up to 2^(i+1) included, as the Prometheus "le" bounds */
+    bucket = duration <= 2 ? 0 : g_bit_storage (duration - 1) - 1;
+    if (bucket >= STATS_N_BUCKETS)
+        bucket = STATS_N_BUCKETS - 1;
+
+    __atomic_add_fetch (&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&histogram->sum, duration, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_request_add:
+ * @method: the method called
+ * @start: when the request was received, from g_get_monotonic_time()
+ * @failed: whether an error was returned
+ *
+ * Count a request which has been replied to, and its latency. Does
+ * nothing if @method is %STATS_N_METHODS.
+ */
+
+void
+stats_request_add (StatsMethod method,
+                   gint64 start,
+                   gboolean failed)
+{
+    if (method >= STATS_N_METHODS)
+        return;
+    histogram_add (&method_histograms[method], start);
+    if (failed)
+        __atomic_add_fetch (&method_errors[method], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_stage_add:
+ * @stage: the stage which has just ended
+ * @start: when it started, from g_get_monotonic_time()
+ *
+ * Count the duration of one run of @stage. May be called from any
+ * thread.
+ */
+
+void
+stats_stage_add (StatsStage stage,
+                 gint64 start)
+{
+    g_assert (stage < STATS_N_STAGES);
+    histogram_add (&stage_histograms[stage], start);
+}
+
+/* A copy, so that the count and the sum of the buckets match */
+static void
+histogram_read (const struct stats_histogram *histogram,
+                struct stats_histogram *copy)
+{
+    guint i;
+
+    copy->count = 0;
+    for (i = 0; i < STATS_N_BUCKETS; i++) {
+        copy->buckets[i] = __atomic_load_n (&histogram->buckets[i], __ATOMIC_RELAXED);
+        copy->count += copy->buckets[i];
+    }
+    copy->sum = __atomic_load_n (&histogram->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_counters_to_variant:
+ *
+ * Returns: (transfer floating): the counters, the gauges with their
+ * maximum, and the request and error counts of each method, as a
+ * dictionary of type a{st}
+ */
+
+GVariant *
+stats_counters_to_variant (void)
+{
+    GVariantBuilder builder;
+    guint i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+    for (i = 0; i < STATS_N_COUNTERS; i++)
+        g_variant_builder_add (&builder, "{st}", counter_names[i], stats_counter_get (i));
+    for (i = 0; i < STATS_N_GAUGES; i++) {
+        gchar *max_name = g_strconcat (gauge_names[i], "_max", NULL);
+
+        g_variant_builder_add (&builder, "{st}", gauge_names[i],
+                               (guint64) MAX (0, __atomic_load_n (&gauges[i].value, __ATOMIC_RELAXED)));
+        g_variant_builder_add (&builder, "{st}", max_name,
+                               (guint64) MAX (0, __atomic_load_n (&gauges[i].max, __ATOMIC_RELAXED)));
+        g_free (max_name);
+    }
+    for (i = 0; i < STATS_N_METHODS; i++) {
+        gchar *requests_name = g_strconcat (method_names[i], ".requests", NULL);
+        gchar *errors_name = g_strconcat (method_names[i], ".errors", NULL);
+        struct stats_histogram copy;
+
+        histogram_read (&method_histograms[i], &copy);
+        g_variant_builder_add (&builder, "{st}", requests_name, copy.count);
+        g_variant_builder_add (&builder, "{st}", errors_name,
+                               __atomic_load_n (&method_errors[i], __ATOMIC_RELAXED));
+        g_free (requests_name);
+        g_free (errors_name);
+    }
+    return g_variant_builder_end (&builder);
+}
+
+static void
+histogram_to_builder (GVariantBuilder *builder,
+                      const gchar *prefix,
+                      const gchar *name,
+                      const struct stats_histogram *histogram)
+{
+    struct stats_histogram copy;
+    gchar *full_name = g_strconcat (prefix, name, NULL);
+
+    histogram_read (histogram, &copy);
+    g_variant_builder_add (builder, "(stt@at)", full_name, copy.count, copy.sum,
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, copy.buckets,
+                                                      STATS_N_BUCKETS, sizeof (guint64)));
+    g_free (full_name);
+}
+
+/**
+ * stats_histograms_to_variant:
+ *
+ * Returns: (transfer floating): the latency histograms, as an array of
+ * type a(sttat): the name ("method.SetLocale", "stage.polkit", ...), the
+ * count, the sum of the durations in microseconds, and the buckets
+ */
+
+GVariant *
+stats_histograms_to_variant (void)
+{
+    GVariantBuilder builder;
+    guint i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttat)"));
+    for (i = 0; i < STATS_N_METHODS; i++)
+        histogram_to_builder (&builder, "method.", method_names[i], &method_histograms[i]);
+    for (i = 0; i < STATS_N_STAGES; i++)
+        histogram_to_builder (&builder, "stage.", stage_names[i], &stage_histograms[i]);
+    return g_variant_builder_end (&builder);
+}
+
+static void
+histogram_to_prometheus (GString *text,
+                         const gchar *metric,
+                         const gchar *label,
+                         const gchar *value,
+                         const struct stats_histogram *histogram)
+{
+    struct stats_histogram copy;
+    guint64 cumulated = 0;
+    guint i;
+
+    histogram_read (histogram, &copy);
+    for (i = 0; i < STATS_N_BUCKETS - 1; i++) {
+        cumulated += copy.buckets[i];
+        g_string_append_printf (text, "%s_bucket{%s=\"%s\",le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                                metric, label, value, (gdouble) (G_GUINT64_CONSTANT (2) << i) / G_USEC_PER_SEC,
+                                cumulated);
+    }
+    g_string_append_printf (text, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                            metric, label, value, copy.count);
+    g_string_append_printf (text, "%s_sum{%s=\"%s\"} %g\n",
+                            metric, label, value, (gdouble) copy.sum / G_USEC_PER_SEC);
+    g_string_append_printf (text, "%s_count{%s=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            metric, label, value, copy.count);
+}
+
+/**
+ * stats_write_textfile:
+ * @path: the file to write
+ * @error: return location for an error
+ *
+ * Write all the statistics to @path, in the Prometheus text format, as
+ * read by the textfile collector of node_exporter. The file is replaced
+ * atomically.
+ *
+ * Returns: %TRUE on success
+ */
+
+gboolean
+stats_write_textfile (const gchar *path,
+                      GError **error)
+{
+    GString *text = g_string_new (NULL);
+    gboolean ret;
+    guint i;
+
+    for (i = 0; i < STATS_N_COUNTERS; i++)
+        g_string_append_printf (text,
+                                "# TYPE blocaled_%s_total counter\n"
+                                "blocaled_%s_total %" G_GUINT64_FORMAT "\n",
+                                counter_names[i], counter_names[i], stats_counter_get (i));
+    for (i = 0; i < STATS_N_GAUGES; i++)
+        g_string_append_printf (text,
+                                "# TYPE blocaled_%s gauge\n"
+                                "blocaled_%s %" G_GINT64_FORMAT "\n"
+                                "# TYPE blocaled_%s_max gauge\n"
+                                "blocaled_%s_max %" G_GINT64_FORMAT "\n",
+                                gauge_names[i], gauge_names[i],
+                                __atomic_load_n (&gauges[i].value, __ATOMIC_RELAXED),
+                                gauge_names[i], gauge_names[i],
+                                __atomic_load_n (&gauges[i].max, __ATOMIC_RELAXED));
+
+    g_string_append (text, "# TYPE blocaled_request_errors_total counter\n");
+    for (i = 0; i < STATS_N_METHODS; i++)
+        g_string_append_printf (text, "blocaled_request_errors_total{method=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                method_names[i], __atomic_load_n (&method_errors[i], __ATOMIC_RELAXED));
+    g_string_append (text, "# TYPE blocaled_request_duration_seconds histogram\n");
+    for (i = 0; i < STATS_N_METHODS; i++)
+        histogram_to_prometheus (text, "blocaled_request_duration_seconds", "method",
+                                 method_names[i], &method_histograms[i]);
+    g_string_append (text, "# TYPE blocaled_stage_duration_seconds histogram\n");
+    for (i = 0; i < STATS_N_STAGES; i++)
+        histogram_to_prometheus (text, "blocaled_stage_duration_seconds", "stage",
+                                 stage_names[i], &stage_histograms[i]);
+
+    ret = g_file_set_contents (path, text->str, text->len, error);
+    g_string_free (text, TRUE);
+    return ret;
+}
+
+static gboolean
+on_textfile_timeout (gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (!stats_write_textfile (textfile, &error)) {
+        g_warning ("Failed to write the statistics: %s", error->message);
+        g_error_free (error);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * stats_set_textfile:
+ * @path: (nullable): the Prometheus textfile, or %NULL for none
+ *
+ * Rewrite the statistics to @path every few seconds, from the main
+ * loop. When a textfile was set before, it is written a last time.
+ */
+
+void
+stats_set_textfile (const gchar *path)
+{
+    if (textfile_id != 0) {
+        g_source_remove (textfile_id);
+        textfile_id = 0;
+        on_textfile_timeout (NULL);
+    }
+    g_free (textfile);
+    textfile = g_strdup (path);
+    if (textfile != NULL) {
+        on_textfile_timeout (NULL);
+        textfile_id = g_timeout_add_seconds (STATS_TEXTFILE_INTERVAL, on_textfile_timeout, NULL);
+    }
+}
+
+/**
+ * stats_log:
+ *
+ * Write the value of all the counters and gauges to the log, and the
+ * request count, error count and mean latency of each method called
+ */
+
+void
+stats_log (void)
+{
+    guint i;
+
+    for (i = 0; i < STATS_N_COUNTERS; i++)
+        g_message ("stats: %s=%" G_GUINT64_FORMAT,
+                   stats_counter_name (i), stats_counter_get (i));
+    for (i = 0; i < STATS_N_GAUGES; i++)
+        g_message ("stats: %s=%" G_GINT64_FORMAT " (max %" G_GINT64_FORMAT ")", gauge_names[i],
+                   __atomic_load_n (&gauges[i].value, __ATOMIC_RELAXED),
+                   __atomic_load_n (&gauges[i].max, __ATOMIC_RELAXED));
+    for (i = 0; i < STATS_N_METHODS; i++) {
+        struct stats_histogram copy;
+
+        histogram_read (&method_histograms[i], &copy);
+        if (copy.count == 0)
+            continue;
+        g_message ("stats: %s requests=%" G_GUINT64_FORMAT " errors=%" G_GUINT64_FORMAT " mean=%" G_GUINT64_FORMAT "us",
+                   method_names[i], copy.count,
+                   __atomic_load_n (&method_errors[i], __ATOMIC_RELAXED),
+                   copy.sum / copy.count);
+    }
+}
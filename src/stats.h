@@ -0,0 +1,137 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: stats
+ * @short_description: Internal counters
+ * @title: Statistics
+ * @include: stats.h
+ *
+ * A fixed set of 64 bit counters, gauges and latency histograms, which
+ * can be updated from any thread without locking. #stats_log writes
+ * their values to the log, and they are also offered on D-Bus (see
+ * org.freedesktop.locale1.Stats.xml) and, optionally, in a Prometheus
+ * textfile.
+ *
+ * The histograms have logarithmic buckets: bucket i counts the
+ * durations up to 2^(i+1) microseconds which are not in the previous
+ * buckets, and the last one counts all the longer ones. The count of a
+ * histogram, and the request count of a method, are always the sum of
+ * its buckets. Since nothing is locked, a reader may see a histogram in
+ * the middle of an update, with a sum not yet including the last
+ * duration.
+ */
+
+#define STATS_N_BUCKETS 24
+
+typedef enum {
+    STATS_DEFERRED_SYNC_OK,
+    STATS_DEFERRED_SYNC_FAILED,
+    STATS_AUTH_CACHE_HIT,
+    STATS_AUTH_CACHE_MISS,
+    STATS_REJECTED_INVALID_ARGS,
+    STATS_NOOP_REQUESTS,
+    STATS_PREPARED_REUSED,
+    STATS_PREPARED_STALE,
+    STATS_N_COUNTERS
+} StatsCounter;
+
+/* The current value is kept, and its maximum */
+typedef enum {
+    STATS_GAUGE_REQUESTS_IN_FLIGHT,
+    STATS_GAUGE_DEFERRED_SYNCS,
+    STATS_N_GAUGES
+} StatsGauge;
+
+typedef enum {
+    STATS_METHOD_SET_LOCALE,
+    STATS_METHOD_SET_VCONSOLE_KEYBOARD,
+    STATS_METHOD_SET_X11_KEYBOARD,
+    STATS_METHOD_SET_LOCALE_VARIABLES,
+    STATS_METHOD_SET_ALL,
+    STATS_METHOD_LIST_LOCALES,
+    STATS_METHOD_LIST_VCONSOLE_KEYMAPS,
+    STATS_METHOD_LIST_X11_LAYOUTS,
+    STATS_N_METHODS
+} StatsMethod;
+
+typedef enum {
+    STATS_STAGE_VALIDATION,
+    STATS_STAGE_POLKIT,
+    STATS_STAGE_MAP_LOOKUP,
+    STATS_STAGE_PARSE,
+    STATS_STAGE_SERIALIZE,
+    STATS_STAGE_WRITE,
+    STATS_STAGE_FSYNC,
+    STATS_N_STAGES
+} StatsStage;
+
+void
+stats_counter_inc (StatsCounter counter);
+
+guint64
+stats_counter_get (StatsCounter counter);
+
+const gchar *
+stats_counter_name (StatsCounter counter);
+
+void
+stats_gauge_add (StatsGauge gauge,
+                 gint64 delta);
+
+StatsMethod
+stats_method_from_name (const gchar *name);
+
+void
+stats_request_add (StatsMethod method,
+                   gint64 start,
+                   gboolean failed);
+
+void
+stats_stage_add (StatsStage stage,
+                 gint64 start);
+
+GVariant *
+stats_counters_to_variant (void);
+
+GVariant *
+stats_histograms_to_variant (void);
+
+gboolean
+stats_write_textfile (const gchar *path,
+                      GError **error);
+
+void
+stats_set_textfile (const gchar *path);
+
+void
+stats_log (void);
+
+#endif
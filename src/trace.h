@@ -0,0 +1,63 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: trace
+ * @short_description: Debug messages of the parsers
+ * @title: Trace
+ * @include: trace.h
+ *
+ * g_debug() formats its message before the log handler may drop it,
+ * which is costly in the parser loops. TRACE() first tests
+ * #trace_enabled, so that neither the message nor its arguments are
+ * evaluated unless debug messages are shown (--debug or
+ * G_MESSAGES_DEBUG=all). With configure --disable-trace, the messages
+ * are not compiled in at all.
+ */
+
+/* config.h is force-included by the Makefiles: this only catches a
+   build which does not, where ENABLE_TRACE would be silently unset */
+#ifndef PACKAGE_NAME
+#error "config.h must be included before trace.h"
+#endif
+
+/* Set once by main.c, read from any thread */
+extern gint trace_enabled;
+
+#define TRACE_ENABLED() G_UNLIKELY (g_atomic_int_get (&trace_enabled))
+
+#ifdef ENABLE_TRACE
+#define TRACE(...) G_STMT_START { if (TRACE_ENABLED ()) g_debug (__VA_ARGS__); } G_STMT_END
+#else
+#define TRACE(...) G_STMT_START { } G_STMT_END
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "fileindex.h"
+#include "xkbindex.h"
+
+#include "config.h"
+
+static FileIndex *xkb_index = NULL;
+static gchar *rules_file = NULL;
+
+/*
+  All the kinds share one index, built from a single read of the rules
+  file, each key being prefixed with the kind. Keep in the same order as
+  XkbIndexKind.
+*/
+static const gchar *kind_prefixes[] = { "model:", "layout:", "variant:", "option:" };
+static const gchar *section_names[] = { "model", "layout", "variant", "option" };
+
+/* The sorted names of each kind, without prefix, made with the index */
+static gchar **kind_lists[] = { NULL, NULL, NULL, NULL };
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+    return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static void
+build_kind_lists (GHashTable *set)
+{
+    GPtrArray *lists[G_N_ELEMENTS (kind_lists)];
+    GHashTableIter iter;
+    gpointer key;
+    guint kind;
+
+    for (kind = 0; kind < G_N_ELEMENTS (kind_lists); kind++)
+        lists[kind] = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, set);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        for (kind = 0; kind < G_N_ELEMENTS (kind_lists); kind++)
+            if (g_str_has_prefix (key, kind_prefixes[kind])) {
+                g_ptr_array_add (lists[kind], g_strdup ((const gchar *) key + strlen (kind_prefixes[kind])));
+                break;
+            }
+    for (kind = 0; kind < G_N_ELEMENTS (kind_lists); kind++) {
+        g_ptr_array_sort (lists[kind], compare_strings);
+        g_ptr_array_add (lists[kind], NULL);
+        g_strfreev (kind_lists[kind]);
+        kind_lists[kind] = (gchar **) g_ptr_array_free (lists[kind], FALSE);
+    }
+}
+
+/*
+  Lines of a rules lst file look like:
+
+  ! layout
+    us              English (US)
+  ! variant
+    intl            us: English (US, intl., with dead keys)
+  ! option
+    grp             Switching to another layout
+    grp:toggle      Right Alt
+*/
+static void
+build_xkb_index (GHashTable *set,
+                 gpointer user_data)
+{
+    gchar *contents = NULL;
+    gchar **lines, **line;
+    gint kind = -1;
+
+    if (!g_file_get_contents (rules_file, &contents, NULL, NULL)) {
+        build_kind_lists (set);
+        return;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        gchar **fields;
+
+        g_strstrip (*line);
+        if (**line == '\0')
+            continue;
+        if (**line == '!') {
+            const gchar *section = g_strchug (*line + 1);
+
+            for (kind = XKB_INDEX_OPTION; kind >= 0; kind--)
+                if (!strcmp (section, section_names[kind]))
+                    break;
+            continue;
+        }
+        if (kind < 0)
+            continue;
+
+        fields = g_strsplit_set (*line, " \t", 2);
+        if (kind == XKB_INDEX_VARIANT) {
+            /* The layout is at the start of the description */
+            const gchar *desc = fields[1] != NULL ? g_strchug (fields[1]) : "";
+            const gchar *colon = strchr (desc, ':');
+
+            if (colon != NULL && colon != desc)
+                g_hash_table_add (set, g_strdup_printf ("%s%.*s(%s)", kind_prefixes[kind],
+                                                        (int) (colon - desc), desc, fields[0]));
+        } else if (kind != XKB_INDEX_OPTION || strchr (fields[0], ':') != NULL) {
+            /* An option without colon is only the name of a group */
+            g_hash_table_add (set, g_strconcat (kind_prefixes[kind], fields[0], NULL));
+        }
+        g_strfreev (fields);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+    build_kind_lists (set);
+}
+
+/**
+ * xkb_index_init:
+ * @_rules_file: the lst file of the xkb rules, normally
+ * %XKB_INDEX_DEFAULT_RULES
+ *
+ * Prepare the index. Nothing is read before the first lookup.
+ */
+
+void
+xkb_index_init (const gchar *_rules_file)
+{
+    const gchar *watched[2];
+
+    rules_file = g_strdup (_rules_file);
+    watched[0] = rules_file;
+    watched[1] = NULL;
+    xkb_index = file_index_new ("XKB", watched, build_xkb_index, NULL);
+}
+
+/**
+ * xkb_index_contains:
+ * @kind: what @name is
+ * @name: a model, layout, option, or "layout(variant)"
+ *
+ * Returns: %TRUE if @name is known to the xkb rules
+ */
+
+gboolean
+xkb_index_contains (XkbIndexKind kind,
+                    const gchar *name)
+{
+    gchar *key;
+    gboolean ret;
+
+    g_assert (xkb_index != NULL);
+    key = g_strconcat (kind_prefixes[kind], name, NULL);
+    ret = file_index_contains (xkb_index, key);
+    g_free (key);
+    return ret;
+}
+
+/**
+ * xkb_index_list:
+ * @kind: what to list
+ *
+ * Returns: (transfer none): a sorted, %NULL terminated, vector of the
+ * names of the given @kind, without prefix. It is sorted once each time
+ * the index is built, and only valid until the index is built again,
+ * that is until the next call of an xkb_index function after a change of
+ * the rules file. Do not free.
+ */
+
+const gchar * const *
+xkb_index_list (XkbIndexKind kind)
+{
+    g_assert (xkb_index != NULL);
+    file_index_ensure_built (xkb_index);
+    return (const gchar * const *) kind_lists[kind];
+}
+
+/**
+ * xkb_index_destroy:
+ *
+ * Free the index
+ */
+
+void
+xkb_index_destroy (void)
+{
+    guint kind;
+
+    g_clear_pointer (&xkb_index, file_index_free);
+    g_clear_pointer (&rules_file, g_free);
+    for (kind = 0; kind < G_N_ELEMENTS (kind_lists); kind++)
+        g_clear_pointer (&kind_lists[kind], g_strfreev);
+}
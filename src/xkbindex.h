@@ -0,0 +1,66 @@
+/*
+  Copyright 2026 blocaled contributors
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+  See git log
+*/
+
+#ifndef _XKB_INDEX_H_
+#define _XKB_INDEX_H_
+
+#include <glib.h>
+
+/**
+ * SECTION: xkbindex
+ * @short_description: Index of the X11 keyboard models, layouts,
+ * variants and options
+ * @title: XKB Index
+ * @include: xkbindex.h
+ *
+ * The names are read from the "lst" summary of the xkb rules, which has
+ * one section for each of the models, layouts, variants and options. A
+ * variant is only valid with its layout, so variants are stored as
+ * "layout(variant)", as in the xkb symbols syntax.
+ */
+
+#define XKB_INDEX_DEFAULT_RULES "/usr/share/X11/xkb/rules/base.lst"
+
+typedef enum {
+    XKB_INDEX_MODEL,
+    XKB_INDEX_LAYOUT,
+    XKB_INDEX_VARIANT,
+    XKB_INDEX_OPTION,
+} XkbIndexKind;
+
+void
+xkb_index_init (const gchar *rules_file);
+
+gboolean
+xkb_index_contains (XkbIndexKind kind,
+                    const gchar *name);
+
+const gchar * const *
+xkb_index_list (XkbIndexKind kind);
+
+void
+xkb_index_destroy (void);
+
+#endif
@@ -28,6 +28,9 @@
 
 static GDBusNodeInfo *introspection_data = NULL;
 
+/* Checks never answered, while scratch/polkit-hold exists */
+static GList *held_invocations = NULL;
+
 /* Introspection data for the service we are exporting */
 static const gchar introspection_xml[] =
   "<node>"
@@ -94,13 +97,19 @@ handle_method_call (GDBusConnection       *connection,
       g_variant_get (parameters, "((sa{sv})&sa{ss}us)", NULL, NULL, &action_id, NULL, &flags, NULL);
 
       if ((g_strcmp0 (action_id, "org.freedesktop.locale1.set-locale") != 0) &&
-          (g_strcmp0 (action_id, "org.freedesktop.locale1.set-keyboard") != 0))
+          (g_strcmp0 (action_id, "org.freedesktop.locale1.set-keyboard") != 0) &&
+          (g_strcmp0 (action_id, "org.freedesktop.locale1.set-all") != 0))
         {
           g_dbus_method_invocation_return_error (invocation,
                                                  POLKIT_ERROR,
                                                  POLKIT_ERROR_NOT_SUPPORTED,
                                                  "Mock Polkit only supports locale1 actions");
         }
+      else if (g_file_test ("scratch/polkit-hold", G_FILE_TEST_EXISTS))
+        {
+          /* As if waiting for a password which never comes */
+          held_invocations = g_list_prepend (held_invocations, invocation);
+        }
       else
         {
           GVariantBuilder *builder;
@@ -0,0 +1,55 @@
+/*
+  Copyright 2019 Pierre Labastie
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* Print the settings published in a state file, then their generation */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blocaled-shm.h"
+
+int
+main (int argc, char *argv[])
+{
+    const struct blocaled_shm *shm;
+    char buf[BLOCALED_SHM_DATA_SIZE + 1];
+    uint64_t generation;
+
+    if (argc != 2) {
+        fprintf (stderr, "Usage: %s STATEFILE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((shm = blocaled_shm_open (argv[1])) == NULL) {
+        perror (argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (blocaled_shm_read (shm, buf, sizeof (buf), &generation) < 0) {
+        perror (argv[1]);
+        blocaled_shm_close (shm);
+        return EXIT_FAILURE;
+    }
+    blocaled_shm_close (shm);
+    printf ("%sgeneration %" PRIu64 "\n", buf, generation);
+    return EXIT_SUCCESS;
+}